@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/device.h>
+
+/*
+ * Extensions to the kscan API for zmk,my-kscan devices. Keys are numbered
+ * row * row_keys + column, with row and column as reported to
+ * kscan_callback_t, and packed 32 to a word, lowest key in bit 0 of word 0.
+ */
+
+/** The debounced changes of one scan. Only valid during the callback. */
+struct my_kscan_frame {
+    /** Uptime in microseconds when the scan started. */
+    int64_t timestamp_us;
+    /** Keys whose debounced state flipped on this scan. */
+    const uint32_t *changed;
+    /** Debounced state of every key after this scan. */
+    const uint32_t *pressed;
+    /** Length of the changed and pressed arrays. */
+    uint16_t words;
+    uint16_t row_keys;
+};
+
+typedef void (*my_kscan_frame_callback_t)(const struct device *dev,
+                                          const struct my_kscan_frame *frame);
+
+/**
+ * Receive one frame per scan that changed any key, before the per-key
+ * kscan_callback_t events of the same scan. A device with a frame callback
+ * may be configured with kscan_config() or not at all. Pass NULL to stop.
+ * With CONFIG_ZMK_MY_KSCAN_IRQ_SCAN the callback may run in an interrupt.
+ */
+int my_kscan_configure_frame(const struct device *dev, my_kscan_frame_callback_t callback);
+
+/**
+ * A read-only view of the matrix state as of the last complete scan. The
+ * arrays are the driver's own and are overwritten by the next scan, so read
+ * them between my_kscan_snapshot_begin() and my_kscan_snapshot_retry():
+ *
+ *     do {
+ *         seq = my_kscan_snapshot_begin(dev, &snapshot);
+ *         ...read snapshot.pressed and snapshot.raw...
+ *     } while (my_kscan_snapshot_retry(dev, seq));
+ *
+ * Requires CONFIG_ZMK_MY_KSCAN_SNAPSHOT.
+ */
+struct my_kscan_snapshot {
+    /** Uptime in microseconds when the last scan started, 0 before the first scan. */
+    int64_t timestamp_us;
+    /** Debounced state of every key. */
+    const uint32_t *pressed;
+    /** Raw key bits read by the last scan, before debouncing. */
+    const uint32_t *raw;
+    /** Length of the pressed and raw arrays. */
+    uint16_t words;
+    uint16_t row_keys;
+};
+
+/** Fill snapshot and return the sequence number to pass to my_kscan_snapshot_retry(). */
+uint32_t my_kscan_snapshot_begin(const struct device *dev, struct my_kscan_snapshot *snapshot);
+
+/** True if a scan changed the snapshot since my_kscan_snapshot_begin() returned seq. */
+bool my_kscan_snapshot_retry(const struct device *dev, uint32_t seq);
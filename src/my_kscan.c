@@ -4,17 +4,31 @@
 * SPDX-License-Identifier: MIT
 */
 #include "kscan_gpio_copy.h"
+#include "my_kscan.h"
+#include "my_kscan_core.h"
+#include "my_kscan_debounce.h"
+#include "my_kscan_stats.h"
+#include "my_kscan_trace.h"
 
 #include <zephyr/device.h>
 #include <zephyr/devicetree.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/kscan.h>
+#include <zephyr/drivers/spi.h>
 #include <zephyr/pm/device.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/shell/shell.h>
+#include <zephyr/stats/stats.h>
 #include <zephyr/sys/__assert.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/barrier.h>
 #include <zephyr/sys/util.h>
 
+#include <stdio.h>
+#include <string.h>
+
 #include <zmk/debounce.h>
 
 LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
@@ -22,13 +36,17 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 #define DT_DRV_COMPAT zmk_my_kscan
 
 #define INST_DIODE_DIR(n) DT_ENUM_IDX(DT_DRV_INST(n), diode_direction)
-#define COND_DIODE_DIR(n, row2col_code, col2row_code)                                              \
-    COND_CODE_0(INST_DIODE_DIR(n), row2col_code, col2row_code)
 
 #define INST_ROWS_LEN(n) DT_INST_PROP_LEN(n, row_gpios)
 #define INST_COLS_LEN(n) DT_INST_PROP_LEN(n, col_gpios)
 #define INST_MATRIX_LEN(n) (2 * INST_ROWS_LEN(n) * INST_COLS_LEN(n))
-#define INST_INPUTS_LEN(n) COND_DIODE_DIR(n, (INST_COLS_LEN(n)), (INST_ROWS_LEN(n)))
+#define INST_LINES_LEN(n) (INST_ROWS_LEN(n) + INST_COLS_LEN(n))
+#define INST_DIRECT_LEN(n) DT_INST_PROP_LEN_OR(n, direct_gpios, 0)
+#define INST_PINS_LEN(n) DT_INST_PROP_LEN(n, gpios)
+#define INST_SENSE_LEN(n) DT_INST_PROP_LEN(n, sense_gpios)
+#define INST_SHIFT_LINES(n) DT_INST_PROP(n, drive_lines)
+#define INST_KEYS_LEN(n, matrix_keys) ((matrix_keys) + INST_DIRECT_LEN(n))
+#define INST_KEY_WORDS(n, matrix_keys) MY_KSCAN_DEBOUNCE_WORDS(INST_KEYS_LEN(n, matrix_keys))
 
 #ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PRESS_MS
 #define INST_DEBOUNCE_PRESS_MS(n) CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PRESS_MS
@@ -47,6 +65,63 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
 #define USE_POLLING IS_ENABLED(CONFIG_ZMK_MY_KSCAN_MATRIX_POLLING)
 #define USE_INTERRUPTS (!USE_POLLING)
 
+#define USE_BATCHED_DRIVE IS_ENABLED(CONFIG_ZMK_MY_KSCAN_MATRIX_BATCHED_DRIVE)
+
+#define USE_DIRECT_POLLING IS_ENABLED(CONFIG_ZMK_MY_KSCAN_DIRECT_POLLING)
+
+#define USE_PACKED_DEBOUNCE IS_ENABLED(CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED)
+
+#define USE_SCAN_THREAD IS_ENABLED(CONFIG_ZMK_MY_KSCAN_SCAN_THREAD)
+
+#define USE_COORDINATOR IS_ENABLED(CONFIG_ZMK_MY_KSCAN_COORDINATOR)
+
+#define USE_IRQ_SCAN IS_ENABLED(CONFIG_ZMK_MY_KSCAN_IRQ_SCAN)
+
+#define USE_SETTLE_CALIBRATION IS_ENABLED(CONFIG_ZMK_MY_KSCAN_SETTLE_CALIBRATION)
+
+#define USE_QUARANTINE IS_ENABLED(CONFIG_ZMK_MY_KSCAN_QUARANTINE)
+
+#define USE_STATS IS_ENABLED(CONFIG_ZMK_MY_KSCAN_STATS)
+
+#define USE_TRACE IS_ENABLED(CONFIG_ZMK_MY_KSCAN_TRACE)
+
+#define USE_SNAPSHOT IS_ENABLED(CONFIG_ZMK_MY_KSCAN_SNAPSHOT)
+
+#define USE_PARTIAL_SCAN IS_ENABLED(CONFIG_ZMK_MY_KSCAN_PARTIAL_SCAN)
+
+#define USE_TUNING IS_ENABLED(CONFIG_ZMK_MY_KSCAN_TUNING)
+
+#define USE_SHIFT_REGISTER IS_ENABLED(CONFIG_ZMK_MY_KSCAN_SHIFT_REGISTER)
+
+#define USE_ENERGY IS_ENABLED(CONFIG_ZMK_MY_KSCAN_ENERGY)
+
+#define USE_SHIFT_REGISTER_ASYNC IS_ENABLED(CONFIG_ZMK_MY_KSCAN_SHIFT_REGISTER_ASYNC)
+
+#if USE_TRACE
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_ZMK_MY_KSCAN_TRACE_FRAMES),
+             "ZMK_MY_KSCAN_TRACE_FRAMES must be a power of two");
+#endif
+
+#if IS_ENABLED(CONFIG_ZMK_MY_KSCAN_DEBOUNCE_DEFER)
+#define KSCAN_DEBOUNCE_STRATEGY MY_KSCAN_DEBOUNCE_DEFER
+#elif IS_ENABLED(CONFIG_ZMK_MY_KSCAN_DEBOUNCE_EAGER)
+#define KSCAN_DEBOUNCE_STRATEGY MY_KSCAN_DEBOUNCE_EAGER
+#elif IS_ENABLED(CONFIG_ZMK_MY_KSCAN_DEBOUNCE_EAGER_DEFER)
+#define KSCAN_DEBOUNCE_STRATEGY MY_KSCAN_DEBOUNCE_EAGER_DEFER
+#else
+#define KSCAN_DEBOUNCE_STRATEGY MY_KSCAN_DEBOUNCE_INTEGRATOR
+#endif
+
+#define INST_SCAN_PERIOD_US(n)                                                                     \
+    DT_INST_PROP_OR(n, scan_period_us, DT_INST_PROP(n, debounce_scan_period_ms) * USEC_PER_MSEC)
+
+#define INST_DEBOUNCE_PRESS_TICKS(n)                                                               \
+    DIV_ROUND_UP(INST_DEBOUNCE_PRESS_MS(n) * USEC_PER_MSEC, INST_SCAN_PERIOD_US(n))
+#define INST_DEBOUNCE_RELEASE_TICKS(n)                                                             \
+    DIV_ROUND_UP(INST_DEBOUNCE_RELEASE_MS(n) * USEC_PER_MSEC, INST_SCAN_PERIOD_US(n))
+
+#define INST_SCAN_BACKOFF(node_id, prop, idx) , DT_PROP_BY_IDX(node_id, prop, idx)
+
 #define COND_INTERRUPTS(code) COND_CODE_1(CONFIG_ZMK_MY_KSCAN_MATRIX_POLLING, (), code)
 #define COND_POLL_OR_INTERRUPTS(pollcode, intcode)                                                 \
     COND_CODE_1(CONFIG_ZMK_MY_KSCAN_MATRIX_POLLING, pollcode, intcode)
@@ -55,7 +130,96 @@ LOG_MODULE_DECLARE(zmk, CONFIG_ZMK_LOG_LEVEL);
     KSCAN_GPIO_GET_BY_IDX(DT_DRV_INST(inst_idx), row_gpios, idx)
 #define KSCAN_GPIO_COL_CFG_INIT(idx, inst_idx)                                                     \
     KSCAN_GPIO_GET_BY_IDX(DT_DRV_INST(inst_idx), col_gpios, idx)
-    
+#define KSCAN_GPIO_DIRECT_CFG_INIT(idx, inst_idx)                                                  \
+    KSCAN_GPIO_GET_BY_IDX(DT_DRV_INST(inst_idx), direct_gpios, idx)
+#define KSCAN_GPIO_PIN_CFG_INIT(idx, inst_idx)                                                     \
+    KSCAN_GPIO_GET_BY_IDX(DT_DRV_INST(inst_idx), gpios, idx)
+#define KSCAN_GPIO_SENSE_CFG_INIT(idx, inst_idx)                                                   \
+    KSCAN_GPIO_GET_BY_IDX(DT_DRV_INST(inst_idx), sense_gpios, idx)
+
+/*
+ * Scan plan generation. Everything below expands to constant tables, so the
+ * port grouping and the state index of every sensed key are resolved at build
+ * time. Lines are compared by the dependency ordinal of their GPIO controller.
+ */
+#define PLAN_PORT_ORD(node_id, prop, idx) DT_DEP_ORD(DT_GPIO_CTLR_BY_IDX(node_id, prop, idx))
+#define PLAN_SAME_PORT(j, node_id, prop, idx)                                                      \
+    (PLAN_PORT_ORD(node_id, prop, j) == PLAN_PORT_ORD(node_id, prop, idx))
+
+#define PLAN_FIRST_ON_PORT_STEP(j, node_id, prop, idx) PLAN_SAME_PORT(j, node_id, prop, idx) ? j :
+/** Index of the first line of prop that is on the same port as line idx. */
+#define PLAN_PORT_INDEX(node_id, prop, idx)                                                        \
+    (LISTIFY(idx, PLAN_FIRST_ON_PORT_STEP, (), node_id, prop, idx) idx)
+
+#define PLAN_PORT_PIN_BIT(j, node_id, prop, idx)                                                   \
+    (PLAN_SAME_PORT(j, node_id, prop, idx) ? BIT(DT_GPIO_PIN_BY_IDX(node_id, prop, j)) : 0)
+#define PLAN_PORT_MASK(node_id, prop, idx)                                                         \
+    (LISTIFY(DT_PROP_LEN(node_id, prop), PLAN_PORT_PIN_BIT, (|), node_id, prop, idx))
+
+#define PLAN_PORT(node_id, prop, idx)                                                              \
+    {                                                                                              \
+        .port = DEVICE_DT_GET(DT_GPIO_CTLR_BY_IDX(node_id, prop, idx)),                            \
+        .mask = PLAN_PORT_INDEX(node_id, prop, idx) == idx ? PLAN_PORT_MASK(node_id, prop, idx)    \
+                                                           : 0,                                    \
+    }
+
+#define PLAN_SENSE(node_id, prop, idx)                                                             \
+    {                                                                                              \
+        .port = PLAN_PORT_INDEX(node_id, prop, idx),                                               \
+        .pin = DT_GPIO_PIN_BY_IDX(node_id, prop, idx),                                             \
+    }
+
+// Split keyboard matrix: row2col keys fill the left cols, col2row keys the right ones.
+// Direct keys follow the last row, wrapping onto further rows of the same width.
+#define PLAN_ROW2COL_KEY(col, row, n) (2 * INST_COLS_LEN(n) * (row) + (col))
+#define PLAN_COL2ROW_KEY(row, col, n) (2 * INST_COLS_LEN(n) * (row) + INST_COLS_LEN(n) + (col))
+
+#define PLAN_ROW2COL_KEYS(node_id, prop, row, n)                                                   \
+    LISTIFY(INST_COLS_LEN(n), PLAN_ROW2COL_KEY, (, ), row, n)
+#define PLAN_COL2ROW_KEYS(node_id, prop, col, n)                                                   \
+    LISTIFY(INST_ROWS_LEN(n), PLAN_COL2ROW_KEY, (, ), col, n)
+
+#define PLAN_ROW2COL_PHASE(node_id, prop, row, n)                                                  \
+    {                                                                                              \
+        .drive = &kscan_matrix_rows_##n[row],                                                      \
+        .sense = &kscan_matrix_col_lines_##n,                                                      \
+        .keys = &kscan_matrix_keys_##n[(row) * INST_COLS_LEN(n)],                                  \
+    }
+#define PLAN_COL2ROW_PHASE(node_id, prop, col, n)                                                  \
+    {                                                                                              \
+        .drive = &kscan_matrix_cols_##n[col],                                                      \
+        .sense = &kscan_matrix_row_lines_##n,                                                      \
+        .keys = &kscan_matrix_keys_##n[INST_ROWS_LEN(n) * INST_COLS_LEN(n) +                       \
+                                       (col) * INST_ROWS_LEN(n)],                                  \
+    }
+
+// Charlieplexed pins: the key from the driven pin to each sensed pin is at row
+// drive, column sense. The driven pin reads its own drive, so it has no key.
+#define PLAN_CHARLIEPLEX_KEY(sense_pin, drive_pin, n)                                              \
+    ((sense_pin) == (drive_pin) ? KSCAN_MATRIX_NO_KEY                                              \
+                                : INST_PINS_LEN(n) * (drive_pin) + (sense_pin))
+#define PLAN_CHARLIEPLEX_KEYS(node_id, prop, drive_pin, n)                                         \
+    LISTIFY(INST_PINS_LEN(n), PLAN_CHARLIEPLEX_KEY, (, ), drive_pin, n)
+
+#define PLAN_CHARLIEPLEX_PHASE(node_id, prop, drive_pin, n)                                        \
+    {                                                                                              \
+        .drive = &kscan_matrix_pins_charlieplex_##n[drive_pin],                                    \
+        .sense = &kscan_matrix_pin_lines_charlieplex_##n,                                          \
+        .keys = &kscan_matrix_keys_charlieplex_##n[(drive_pin) * INST_PINS_LEN(n)],                \
+    }
+
+// Shift register outputs: the key from output drive to sense line sense is at
+// row drive, column sense. The phase drives the output with its own index.
+#define PLAN_SHIFT_KEY(node_id, prop, sense, drive) (DT_PROP_LEN(node_id, prop) * (drive) + (sense))
+#define PLAN_SHIFT_KEYS(drive, n)                                                                  \
+    DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, sense_gpios, PLAN_SHIFT_KEY, (, ), drive)
+
+#define PLAN_SHIFT_PHASE(drive, n)                                                                 \
+    {                                                                                              \
+        .sense = &kscan_matrix_sense_lines_shift_##n,                                              \
+        .keys = &kscan_matrix_keys_shift_##n[(drive) * INST_SENSE_LEN(n)],                         \
+    }
+
 enum kscan_diode_direction {
     KSCAN_ROW2COL,
     KSCAN_COL2ROW,
@@ -66,503 +230,3140 @@ struct kscan_matrix_irq_callback {
     struct gpio_callback callback;
 };
 
+/** A GPIO port holding some of the lines of a list. */
+struct kscan_matrix_port {
+    const struct device *port;
+    /**
+     * Pins of the list on this port, or 0 if an earlier line of the list is
+     * on the same port and that entry covers this one.
+     */
+    gpio_port_pins_t mask;
+};
+
+/** Location of a sensed line in the port words read for its list. */
+struct kscan_matrix_sense {
+    uint8_t port;
+    gpio_pin_t pin;
+};
+
+/** The rows or the columns of the matrix, grouped by port at build time. */
+struct kscan_matrix_lines {
+    /** Array of length len. */
+    const struct kscan_gpio *gpios;
+    /** Array of length len, one entry per line. */
+    const struct kscan_matrix_port *ports;
+    /** Array of length len, one entry per line. */
+    const struct kscan_matrix_sense *sense;
+    size_t len;
+};
+
+/** Entry of kscan_matrix_phase.keys for a sensed line that has no key in that phase. */
+#define KSCAN_MATRIX_NO_KEY UINT16_MAX
+
+/** One drive step of the scan plan. */
+struct kscan_matrix_phase {
+    /** NULL if the phase drives the shift register output with the index of the phase. */
+    const struct kscan_gpio *drive;
+    const struct kscan_matrix_lines *sense;
+    /** Array of length sense->len: state index of the key on each sensed line. */
+    const uint16_t *keys;
+};
+
+#if USE_STATS
+#if IS_ENABLED(CONFIG_STATS)
+STATS_SECT_START(my_kscan)
+STATS_SECT_ENTRY32(scans)
+STATS_SECT_ENTRY32(events)
+STATS_SECT_ENTRY32(irq_wakes)
+STATS_SECT_ENTRY32(overruns)
+STATS_SECT_ENTRY32(max_scan_us)
+STATS_SECT_ENTRY32(max_irq_us)
+STATS_SECT_ENTRY32(max_press_us)
+#if USE_ENERGY
+STATS_SECT_ENTRY32(poll_wakes)
+STATS_SECT_ENTRY32(arm_toggles)
+STATS_SECT_ENTRY32(presses)
+STATS_SECT_ENTRY32(settle_ms)
+STATS_SECT_ENTRY32(drive_ms)
+STATS_SECT_ENTRY32(tail_ms)
+STATS_SECT_ENTRY32(resumes)
+#endif
+STATS_SECT_END;
+
+STATS_NAME_START(my_kscan)
+STATS_NAME(my_kscan, scans)
+STATS_NAME(my_kscan, events)
+STATS_NAME(my_kscan, irq_wakes)
+STATS_NAME(my_kscan, overruns)
+STATS_NAME(my_kscan, max_scan_us)
+STATS_NAME(my_kscan, max_irq_us)
+STATS_NAME(my_kscan, max_press_us)
+#if USE_ENERGY
+STATS_NAME(my_kscan, poll_wakes)
+STATS_NAME(my_kscan, arm_toggles)
+STATS_NAME(my_kscan, presses)
+STATS_NAME(my_kscan, settle_ms)
+STATS_NAME(my_kscan, drive_ms)
+STATS_NAME(my_kscan, tail_ms)
+STATS_NAME(my_kscan, resumes)
+#endif
+STATS_NAME_END(my_kscan);
+#endif
+
+/** Timing of the scan path, all durations in microseconds. */
+struct kscan_matrix_stats {
+    /** Whole scan, from the first drive to the last event sent. */
+    struct my_kscan_histogram scan;
+    /** Each half of the duplex pass, indexed by enum kscan_diode_direction. */
+    struct my_kscan_histogram half[2];
+    /** GPIO interrupt to the start of the scan it triggered. */
+    struct my_kscan_histogram irq;
+    /** First scan to see a key after the matrix was idle, to its press event. */
+    struct my_kscan_histogram press;
+    /** Scan deadline to the start of the scan. */
+    struct my_kscan_histogram lateness;
+    uint32_t scans;
+    uint32_t events;
+    /** Uptime when the counters were last cleared. */
+    int64_t since_ms;
+    /** Cycle count of the pending GPIO interrupt, valid if irq_pending. */
+    uint32_t irq_cycles;
+    bool irq_pending;
+    /** Cycle count the pending press latency is measured from, valid if press_pending. */
+    uint32_t press_cycles;
+    bool press_pending;
+#if USE_ENERGY
+    /** Scans started with the matrix idle and no interrupt: polls and slow checks. */
+    uint32_t poll_wakes;
+    /** Expirations of the timer that swaps the armed half of an idle duplex matrix. */
+    uint32_t arm_toggles;
+    uint32_t presses;
+    uint32_t resumes;
+    /** Busy waits for lines to settle. */
+    uint64_t settle_us;
+    /** Time lines were held driven by scans. */
+    uint64_t drive_us;
+    /** Time scanning went on after every key read released, until the matrix was idle. */
+    uint64_t tail_us;
+    /** Start of the last scan that read a key pressed, or 0 once counted in tail_us. */
+    int64_t last_raw_us;
+    /** Some key read pressed on the current scan. */
+    bool raw_pressed;
+#endif
+#if IS_ENABLED(CONFIG_STATS)
+    STATS_SECT_DECL(my_kscan) group;
+#endif
+};
+#endif // USE_STATS
+
+#if USE_SHIFT_REGISTER
+/** A chain of 74HC595-style shift registers whose outputs drive the phases. */
+struct kscan_matrix_shift_register {
+    /** The latch clock follows chip select, so every transfer updates the outputs. */
+    struct spi_dt_spec spi;
+    /** Bytes shifted per transfer, one per register in the chain. */
+    uint8_t bytes;
+};
+
+/** Values of kscan_matrix_data.shift_line besides the index of one output. */
+#define KSCAN_MATRIX_SHIFT_NONE -1
+#define KSCAN_MATRIX_SHIFT_ARMED -2
+#endif
+
+#if USE_SETTLE_CALIBRATION
+/** Busy waits of one scan phase measured at init, in microseconds. */
+struct kscan_matrix_settle {
+    /** After driving the line, before reading the sense ports. */
+    uint8_t before_inputs_us;
+    /** After releasing the line, before the next phase drives its own. */
+    uint8_t between_outputs_us;
+};
+#endif
+
+#if USE_TUNING
+/** Scan parameters that can be changed at runtime, in the units of the devicetree. */
+struct kscan_matrix_tuning {
+    /** Replaces the first entry of config->scan_periods_us. */
+    uint32_t scan_period_us;
+    uint32_t poll_period_us;
+    uint16_t debounce_press_ms;
+    uint16_t debounce_release_ms;
+};
+
+#if USE_STATS
+/** Timing measured while one set of parameters was in use. */
+struct kscan_matrix_tuning_report {
+    struct kscan_matrix_tuning tuning;
+    uint32_t seconds;
+    uint32_t scans_per_s;
+    uint32_t scan_avg_us;
+    uint32_t presses;
+    uint32_t press_p50_us;
+    uint32_t press_p99_us;
+#if USE_ENERGY
+    uint32_t scans_per_press;
+    uint32_t drive_us_per_press;
+#endif
+    bool valid;
+};
+#endif
+#endif // USE_TUNING
+
 struct kscan_matrix_data {
     const struct device *dev;
     struct kscan_gpio_list inputs;
     struct kscan_gpio_list outputs;
+    /** Port words read in the current phase, indexed like kscan_matrix_lines.ports. */
+    gpio_port_value_t *port_values;
+#if USE_SHIFT_REGISTER
+    /** Transmit buffer of the shift register, config->shift_register->bytes long. */
+    uint8_t *shift_pattern;
+    /** Output driven by the last pattern shifted out, or a KSCAN_MATRIX_SHIFT_* value. */
+    int16_t shift_line;
+#if USE_SHIFT_REGISTER_ASYNC
+    /** Raised by the SPI driver when the transfer in flight has been latched. */
+    struct k_poll_signal shift_signal;
+    bool shift_busy;
+#endif
+#endif
     kscan_callback_t callback;
+    my_kscan_frame_callback_t frame_callback;
+#if USE_SCAN_THREAD
+    struct k_thread thread;
+    /** Given when a scan is due. The scan thread runs one scan per take. */
+    struct k_sem scan_sem;
+    /** One-shot timer that gives scan_sem at the absolute time scan_time. */
+    struct k_timer scan_timer;
+#elif USE_COORDINATOR
+    /** Set while a scan is due at scan_time_us. Protected by the coordinator lock. */
+    bool scan_pending;
+#else
     struct k_work_delayable work;
-#if USE_INTERRUPTS
-    /** Array of length config->inputs.len */
-    struct kscan_matrix_irq_callback *irqs;
 #endif
-    /** Timestamp of the current or scheduled scan. */
-    int64_t scan_time;
+#if USE_INTERRUPTS
     /**
-     * Current state of the matrix as a flattened 2D array of length
-     * (config->rows * config->cols)
+     * One per port entry of config->row_lines, config->col_lines, then the
+     * direct pins. Only entries with a port mask are used.
      */
-    struct zmk_debounce_state *matrix_state;
+    struct kscan_matrix_irq_callback *irqs;
+    /** Swaps the armed half of the matrix while waiting for an interrupt. */
+    struct k_timer arm_timer;
+    /** Protects armed and armed_half against the GPIO and timer ISRs. */
+    struct k_spinlock arm_lock;
+    bool armed;
+    /** Half of the matrix whose keys can currently raise an interrupt. */
+    enum kscan_diode_direction armed_half;
+#if !USE_BATCHED_DRIVE
+    /** Swaps the armed half from a thread when that means reconfiguring the lines. */
+    struct k_work arm_work;
+    /** Set while every line is an open-source output, see kscan_matrix_wake_drive(). */
+    bool wake_drive;
+#endif
+#endif
+#if IS_ENABLED(CONFIG_PM_DEVICE)
+    /** Set once the pins have been checked and calibrated, so a resume only reconfigures them. */
+    bool pins_ready;
+#endif
+    /** Uptime in microseconds of the current or scheduled scan. */
+    int64_t scan_time_us;
+    /** Index into config->scan_periods_us of the current period. */
+    uint8_t cadence_step;
+    /** Scans at the current period without any key being debounced. */
+    uint16_t quiet_scans;
+#if USE_QUARANTINE
+    /** Uptime in microseconds since when the pressed keys have all been settled. */
+    int64_t quiet_since_us;
+#endif
+    /** Scan deadlines that had already passed and were skipped. */
+    uint32_t overruns;
+    /** Largest delay seen between a scan's deadline and the scan starting. */
+    uint32_t max_lateness_us;
+#if USE_STATS
+    struct kscan_matrix_stats stats;
+#endif
+#if USE_TRACE
+    struct my_kscan_trace trace;
+    /** Raw key bits of the frame being traced by the current scan, or NULL. */
+    uint32_t *trace_keys;
+#endif
+#if USE_SNAPSHOT
+    /** Odd while a scan is publishing its results. */
+    atomic_t snapshot_seq;
+    /** Keeps readers on this CPU from interrupting a publish. */
+    struct k_spinlock snapshot_lock;
+    int64_t snapshot_time_us;
+    /** Raw key bits of the last complete scan. */
+    uint32_t *snapshot_raw;
+    /** Raw key bits of the scan in progress. */
+    uint32_t *scan_raw;
+#endif
+#if USE_PARTIAL_SCAN
+    /** Phases with a key that is pressed or being debounced, one bit per phase. */
+    uint32_t *hot_phases;
+    /** First phase of the sweep through the other phases in the current scan. */
+    uint16_t sweep_start;
+    /** Number of phases swept in the current scan, from sweep_start on. */
+    uint16_t sweep_len;
+#endif
+#if USE_SETTLE_CALIBRATION
+    /** Array of length config->phases_len, indexed like the phases. */
+    struct kscan_matrix_settle *settle;
+#endif
+#if USE_TUNING
+    /** Parameters used by the scan. Only the scan changes them, before it starts. */
+    struct kscan_matrix_tuning tuning;
+    /** config->core with the debounce thresholds derived from tuning. */
+    struct my_kscan_core_config core_config;
+    /** Parameters last requested, taken over by the next scan if tuning_pending is set. */
+    struct kscan_matrix_tuning tuning_next;
+    struct k_spinlock tuning_lock;
+    atomic_t tuning_pending;
+#if USE_STATS
+    /** Timing measured under the parameters used before the current ones. */
+    struct kscan_matrix_tuning_report tuning_before;
+#endif
+#endif
+    /** Debounced state of the matrix and the keys changed by the current scan. */
+    struct my_kscan_core core;
 };
 
 struct kscan_matrix_config {
-    struct zmk_debounce_config debounce_config;
+    struct my_kscan_core_config core;
     size_t rows;
     size_t cols;
-    int32_t debounce_scan_period_ms;
-    int32_t poll_period_ms;
+    const struct kscan_matrix_lines *row_lines;
+    /**
+     * NULL for charlieplexed pins, which are all listed in row_lines and have
+     * no halves that can be armed for wake, and for a shift register, whose
+     * sense lines are listed in row_lines while rows counts its outputs.
+     */
+    const struct kscan_matrix_lines *col_lines;
+#if USE_SHIFT_REGISTER
+    /** Drives the phases instead of GPIOs, or NULL. */
+    const struct kscan_matrix_shift_register *shift_register;
+#endif
+    /**
+     * Duplex matrix: one phase per row, then one per column. Charlieplexed
+     * pins: one phase per pin. Shift register: one phase per output.
+     */
+    const struct kscan_matrix_phase *phases;
+    size_t phases_len;
+    /** Keys wired straight to a pin, read after the matrix on every scan, or NULL. */
+    const struct kscan_matrix_lines *direct_lines;
+    /** State index of the key on the first direct pin. */
+    uint16_t direct_key;
+#if USE_PACKED_DEBOUNCE
+    /** debounce-overrides: row, column, press ms and release ms of each overridden key. */
+    const uint32_t *debounce_overrides;
+    uint16_t debounce_overrides_len;
+#endif
+    /**
+     * Time between scans while any key is pressed, fastest first. Debouncing
+     * always runs at the first period; the later ones are stepped through
+     * after backoff_scans scans in which no key was being debounced.
+     */
+    const uint32_t *scan_periods_us;
+    uint8_t scan_periods_len;
+    uint16_t backoff_scans;
+    /** Longest time between scans while no key is pressed, when polling. */
+    uint32_t poll_period_us;
+#if USE_TUNING
+    /** Devicetree values of the parameters that can be tuned. */
+    struct kscan_matrix_tuning tuning;
+#endif
+    int32_t wake_toggle_period_ms;
     enum kscan_diode_direction diode_direction;
+#if USE_SCAN_THREAD
+    k_thread_stack_t *stack;
+    size_t stack_size;
+#endif
 };
 
+/** Shift register driving the phases, or NULL if they drive GPIOs. */
+static inline const struct kscan_matrix_shift_register *
+kscan_matrix_shifter(const struct device *dev) {
+#if USE_SHIFT_REGISTER
+    const struct kscan_matrix_config *config = dev->config;
 
-int my_kscan_gpio_pin_get(const struct kscan_gpio *gpio, struct kscan_gpio_port_state *state) {
-    if (gpio->spec.port != state->port) {
-        state->port = gpio->spec.port;
+    return config->shift_register;
+#else
+    return NULL;
+#endif
+}
 
-        const int err = gpio_port_get(state->port, &state->value);
-        if (err) {
-            return err;
-        }
-    }
+/** Core configuration to debounce with, tuned at runtime if enabled. */
+static inline const struct my_kscan_core_config *
+kscan_matrix_core_config(const struct device *dev) {
+#if USE_TUNING
+    const struct kscan_matrix_data *data = dev->data;
 
-    return (state->value & BIT(gpio->spec.pin)) != 0;
+    return &data->core_config;
+#else
+    const struct kscan_matrix_config *config = dev->config;
+
+    return &config->core;
+#endif
 }
 
-#if USE_INTERRUPTS
-static int kscan_matrix_interrupt_configure(const struct device *dev, const gpio_flags_t flags) {
+/** Time between scans at a cadence step. Steps past the scan periods poll. */
+static inline uint32_t kscan_matrix_period_us(const struct device *dev, const int step) {
+    const struct kscan_matrix_config *config = dev->config;
+#if USE_TUNING
     const struct kscan_matrix_data *data = dev->data;
 
-    for (int i = 0; i < data->inputs.len; i++) {
-        const struct gpio_dt_spec *gpio = &data->inputs.gpios[i].spec;
-
-        int err = gpio_pin_interrupt_configure_dt(gpio, flags);
-        if (err) {
-            LOG_ERR("Unable to configure interrupt for pin %u on %s", gpio->pin, gpio->port->name);
-            return err;
-        }
+    if (step == 0) {
+        return data->tuning.scan_period_us;
+    }
+    if (step >= config->scan_periods_len) {
+        return data->tuning.poll_period_us;
+    }
+#else
+    if (step >= config->scan_periods_len) {
+        return config->poll_period_us;
     }
+#endif
 
-    return 0;
+    return config->scan_periods_us[step];
 }
-#endif 
 
-#if USE_INTERRUPTS
-static int kscan_matrix_interrupt_enable(const struct device *dev) {
-    int err = kscan_matrix_interrupt_configure(dev, GPIO_INT_LEVEL_ACTIVE);
-    if (err) {
-        return err;
-    }
 
-    // While interrupts are enabled, set all outputs active so a pressed key
-    // will trigger an interrupt.
-    return kscan_matrix_set_all_outputs(dev, 1);
+#if USE_SCAN_THREAD
+static void kscan_matrix_scan_timer_handler(struct k_timer *timer) {
+    struct kscan_matrix_data *data = CONTAINER_OF(timer, struct kscan_matrix_data, scan_timer);
+
+    k_sem_give(&data->scan_sem);
 }
 #endif
 
-#if USE_INTERRUPTS
-static int kscan_matrix_interrupt_disable(const struct device *dev) {
-    int err = kscan_matrix_interrupt_configure(dev, GPIO_INT_DISABLE);
-    if (err) {
-        return err;
+#if USE_COORDINATOR
+#define KSCAN_MATRIX_INSTANCES                                                                     \
+    (DT_NUM_INST_STATUS_OKAY(zmk_my_kscan) + DT_NUM_INST_STATUS_OKAY(zmk_my_kscan_charlieplex) +   \
+     DT_NUM_INST_STATUS_OKAY(zmk_my_kscan_shift_register))
+
+/*
+ * One work item runs the scans of every matrix. A pass scans each matrix due
+ * within the alignment window, early if need be, and moves its deadline to
+ * the pass, so matrices that are active at once settle onto one shared
+ * wakeup instead of each keeping its own timer.
+ */
+static void kscan_matrix_coordinator_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(kscan_matrix_coordinator_work, kscan_matrix_coordinator_handler);
+static struct k_spinlock kscan_matrix_coordinator_lock;
+static const struct device *kscan_matrix_coordinated[KSCAN_MATRIX_INSTANCES];
+static uint8_t kscan_matrix_coordinated_len;
+
+/** Schedule the next pass for the earliest pending scan. Call with the lock held. */
+static void kscan_matrix_coordinate(void) {
+    int64_t due_us = INT64_MAX;
+
+    for (int i = 0; i < kscan_matrix_coordinated_len; i++) {
+        const struct kscan_matrix_data *data = kscan_matrix_coordinated[i]->data;
+
+        if (data->scan_pending && data->scan_time_us < due_us) {
+            due_us = data->scan_time_us;
+        }
     }
 
-    // While interrupts are disabled, set all outputs inactive so
-    // kscan_matrix_read() can scan them one by one.
-    return kscan_matrix_set_all_outputs(dev, 0);
+    if (due_us == INT64_MAX) {
+        k_work_cancel_delayable(&kscan_matrix_coordinator_work);
+    } else {
+        k_work_reschedule(&kscan_matrix_coordinator_work, K_TIMEOUT_ABS_US(due_us));
+    }
 }
 #endif
 
-#if USE_INTERRUPTS
-static void kscan_matrix_irq_callback_handler(const struct device *port, struct gpio_callback *cb,
-                                            const gpio_port_pins_t pin) {
-    struct kscan_matrix_irq_callback *irq_data =
-        CONTAINER_OF(cb, struct kscan_matrix_irq_callback, callback);
-    struct kscan_matrix_data *data = irq_data->dev->data;
-
-    // Disable our interrupts temporarily to avoid re-entry while we scan.
-    kscan_matrix_interrupt_disable(data->dev);
+/**
+ * Run the next scan after timeout, replacing any scan that is already
+ * scheduled. The coordinator takes the deadline from scan_time_us instead,
+ * which every caller has already set to match timeout.
+ */
+static void kscan_matrix_schedule(struct kscan_matrix_data *data, k_timeout_t timeout) {
+#if USE_SCAN_THREAD
+    if (K_TIMEOUT_EQ(timeout, K_NO_WAIT)) {
+        k_timer_stop(&data->scan_timer);
+        k_sem_give(&data->scan_sem);
+    } else {
+        k_timer_start(&data->scan_timer, timeout, K_NO_WAIT);
+    }
+#elif USE_COORDINATOR
+    k_spinlock_key_t key = k_spin_lock(&kscan_matrix_coordinator_lock);
 
-    data->scan_time = k_uptime_get();
+    data->scan_pending = true;
+    kscan_matrix_coordinate();
 
-    k_work_reschedule(&data->work, K_NO_WAIT);
+    k_spin_unlock(&kscan_matrix_coordinator_lock, key);
+#else
+    k_work_reschedule(&data->work, timeout);
+#endif
 }
+
+static void kscan_matrix_cancel(struct kscan_matrix_data *data) {
+#if USE_SCAN_THREAD
+    k_timer_stop(&data->scan_timer);
+    k_sem_reset(&data->scan_sem);
+#elif USE_COORDINATOR
+    k_spinlock_key_t key = k_spin_lock(&kscan_matrix_coordinator_lock);
+
+    data->scan_pending = false;
+    kscan_matrix_coordinate();
+
+    k_spin_unlock(&kscan_matrix_coordinator_lock, key);
+#else
+    k_work_cancel_delayable(&data->work);
 #endif
+}
 
-static void kscan_matrix_read_continue(const struct device *dev) {
-    const struct kscan_matrix_config *config = dev->config;
-    struct kscan_matrix_data *data = dev->data;
+static inline int64_t kscan_matrix_now_us(void) {
+    return k_ticks_to_us_floor64(k_uptime_ticks());
+}
 
-    data->scan_time += config->debounce_scan_period_ms;
+/**
+ * Move scan_time_us forward by one period. If that deadline has already
+ * passed, keep to the original grid and skip to the first deadline still in
+ * the future rather than running the missed scans back to back.
+ */
+static void kscan_matrix_advance(struct kscan_matrix_data *data, const uint32_t period_us) {
+    const int64_t now = kscan_matrix_now_us();
 
-    k_work_reschedule(&data->work, K_TIMEOUT_ABS_MS(data->scan_time));
+    data->scan_time_us += period_us;
+
+    if (data->scan_time_us < now) {
+        const int64_t missed = (now - data->scan_time_us + period_us - 1) / period_us;
+
+        data->scan_time_us += missed * period_us;
+        data->overruns += missed;
+    }
 }
 
-static void kscan_matrix_read_end(const struct device *dev) {
-#if USE_INTERRUPTS
-    // Return to waiting for an interrupt.
-    kscan_matrix_interrupt_enable(dev);
-#else
+/**
+ * Pick the period until the next scan. Any key being debounced drops back to
+ * the fastest period. Otherwise the period steps up the table after every
+ * backoff_scans scans, and past its end to the poll period once idle.
+ */
+static uint32_t kscan_matrix_cadence_us(const struct device *dev, const bool idle) {
     struct kscan_matrix_data *data = dev->data;
     const struct kscan_matrix_config *config = dev->config;
+    const int last_step = config->scan_periods_len - (idle ? 0 : 1);
+
+    if (my_kscan_core_is_settling(&data->core)) {
+        data->cadence_step = 0;
+        data->quiet_scans = 0;
+    } else if (data->cadence_step < last_step && ++data->quiet_scans >= config->backoff_scans) {
+        data->cadence_step++;
+        data->quiet_scans = 0;
+    } else if (data->cadence_step > last_step) {
+        // A key was pressed while polling at the idle period.
+        data->cadence_step = last_step;
+    }
 
-    data->scan_time += config->poll_period_ms;
-
-    // Return to polling slowly.
-    k_work_reschedule(&data->work, K_TIMEOUT_ABS_MS(data->scan_time));
-#endif
+    return kscan_matrix_period_us(dev, data->cadence_step);
 }
 
-static int set_pin_as_input(const struct gpio_dt_spec *pin) {
-    int err = gpio_pin_configure_dt(pin, GPIO_INPUT | GPIO_PULL_DOWN);
-    if (err) {
-        LOG_ERR("Unable to configure pin %u on %s for input", pin->pin, pin->port->name);
-        return err;
-    }
+static int kscan_matrix_read_ports(const struct kscan_matrix_lines *lines,
+                                   gpio_port_value_t *values) {
+    for (int i = 0; i < lines->len; i++) {
+        const struct kscan_matrix_port *port = &lines->ports[i];
+        if (!port->mask) {
+            continue;
+        }
 
-    // LOG_DBG("Configured pin %u on %s for input", pin->pin, pin->port->name);
+        const int err = gpio_port_get_raw(port->port, &values[i]);
+        if (err) {
+            LOG_ERR("Failed to read port %s: %i", port->port->name, err);
+            return err;
+        }
+    }
 
     return 0;
 }
 
-static int kscan_matrix_init_output_inst(const struct device *dev,
-                                        const struct gpio_dt_spec *gpio) {
-    if (!device_is_ready(gpio->port)) {
-        LOG_ERR("GPIO is not ready: %s", gpio->port->name);
-        return -ENODEV;
+#if USE_SHIFT_REGISTER
+/** Wait until the pattern in flight, if any, drives the outputs. */
+static int kscan_matrix_shift_wait(const struct device *dev) {
+#if USE_SHIFT_REGISTER_ASYNC
+    struct kscan_matrix_data *data = dev->data;
+    struct k_poll_event event = K_POLL_EVENT_INITIALIZER(
+        K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, &data->shift_signal);
+    unsigned int signaled;
+    int result;
+
+    if (!data->shift_busy) {
+        return 0;
     }
 
-    int err = gpio_pin_configure_dt(gpio, GPIO_OUTPUT_HIGH);
+    data->shift_busy = false;
+
+    const int err = k_poll(&event, 1, K_FOREVER);
     if (err) {
-        LOG_ERR("Unable to configure pin %u on %s for output", gpio->pin, gpio->port->name);
         return err;
     }
 
-    // LOG_DBG("Configured pin %u on %s for output", gpio->pin, gpio->port->name);
-
+    k_poll_signal_check(&data->shift_signal, &signaled, &result);
+    return result;
+#else
     return 0;
+#endif
 }
 
-static int kscan_matrix_read(const struct device *dev) {
+/**
+ * Shift data->shift_pattern out. The outputs change as the transfer ends.
+ * With SPI_ASYNC this returns once the transfer has started, and the pattern
+ * must not change until kscan_matrix_shift_wait().
+ */
+static int kscan_matrix_shift_send(const struct device *dev) {
     struct kscan_matrix_data *data = dev->data;
-    const struct kscan_matrix_config *config = dev->config;
-    struct kscan_gpio_list *rows = &data->inputs;
-    struct kscan_gpio_list *cols = &data->outputs;
-
-    const size_t MATRIX_COLS = config->cols * 2; // Split keyboard matrix
-    LOG_INF("Scanning matrix %s with %zu rows and %zu cols", dev->name, rows->len,
-            cols->len);
-    // Scan the matrix.
-    for (int row = 0; row < rows->len; row++) {
-        LOG_INF("Scanning row %i", row);
-        const struct kscan_gpio *row_gpio = &rows->gpios[row];
-        int err = kscan_matrix_init_output_inst(dev, &row_gpio->spec);
-        if (err) {
-            LOG_ERR("Failed to set output %i active: %i", row_gpio->index, err);
-            return err;
-        }
+    const struct kscan_matrix_shift_register *shifter = kscan_matrix_shifter(dev);
+    const struct spi_buf buf = {.buf = data->shift_pattern, .len = shifter->bytes};
+    const struct spi_buf_set tx = {.buffers = &buf, .count = 1};
+
+#if USE_SHIFT_REGISTER_ASYNC
+    k_poll_signal_reset(&data->shift_signal);
 
-#if CONFIG_MY_KSCAN_MATRIX_WAIT_BEFORE_INPUTS > 0
-        k_busy_wait(CONFIG_MY_KSCAN_MATRIX_WAIT_BEFORE_INPUTS);
+    const int err =
+        spi_write_signal(shifter->spi.bus, &shifter->spi.config, &tx, &data->shift_signal);
+    data->shift_busy = !err;
+#else
+    const int err = spi_write_dt(&shifter->spi, &tx);
 #endif
-        struct kscan_gpio_port_state state = {0};
+    if (err) {
+        LOG_ERR("Failed to write the shift register on %s: %i", shifter->spi.bus->name, err);
+    }
 
-        for (int col = 0; col < cols->len; col++) {
-            const struct kscan_gpio *col_gpio = &cols->gpios[col];
+    return err;
+}
 
-            const int index = MATRIX_COLS * row + col;
-            const int active = my_kscan_gpio_pin_get(col_gpio, &state);
-            if (active < 0) {
-                LOG_ERR("Failed to read port %s: %i", col_gpio->spec.port->name, active);
-                return active;
-            }
-            if (active) {
-                LOG_INF("1 - Index %i, row %i, col %i, active %i, pins %d and %d", index, row,
-                        col, active, row_gpio->index, col_gpio->index);
-            }
-            zmk_debounce_update(&data->matrix_state[index], active, config->debounce_scan_period_ms,
-                                &config->debounce_config);
+/** Set output line in the pattern. The last byte shifted out ends up in the first register. */
+static inline void kscan_matrix_shift_set(const struct device *dev, const int line,
+                                          const bool value) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_shift_register *shifter = kscan_matrix_shifter(dev);
+    uint8_t *byte = &data->shift_pattern[shifter->bytes - 1 - line / 8];
+
+    *byte = value ? *byte | BIT(line % 8) : *byte & ~BIT(line % 8);
+}
+
+/** Drive output line alone, or no output for KSCAN_MATRIX_SHIFT_NONE. */
+static int kscan_matrix_shift_drive(const struct device *dev, const int line) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_shift_register *shifter = kscan_matrix_shifter(dev);
+
+    const int err = kscan_matrix_shift_wait(dev);
+    if (err) {
+        return err;
+    }
+
+    memset(data->shift_pattern, 0, shifter->bytes);
+    if (line >= 0) {
+        kscan_matrix_shift_set(dev, line, true);
+    }
+    data->shift_line = line;
+
+    return kscan_matrix_shift_send(dev);
+}
+#endif // USE_SHIFT_REGISTER
+
+#if USE_INTERRUPTS
+static int kscan_matrix_drive_line(const struct device *dev, const struct gpio_dt_spec *gpio,
+                                   const bool active);
+#if !USE_BATCHED_DRIVE
+static int set_pin_as_input(const struct gpio_dt_spec *pin);
+#endif
+
+/** Drive or release every line of a list at once. */
+static int kscan_matrix_set_all_lines(const struct device *dev,
+                                      const struct kscan_matrix_lines *lines, const int value) {
+#if USE_BATCHED_DRIVE
+    for (int i = 0; i < lines->len; i++) {
+        const struct kscan_matrix_port *port = &lines->ports[i];
+        if (!port->mask) {
+            continue;
         }
 
-        err = set_pin_as_input(&row_gpio->spec);
+        const int err = gpio_port_set_masked_raw(port->port, port->mask, value ? port->mask : 0);
         if (err) {
-            LOG_ERR("Failed to set output %i inactive: %i", row_gpio->index, err);
+            LOG_ERR("Failed to set outputs on %s to %d: %i", port->port->name, value, err);
             return err;
         }
-
-#if CONFIG_MY_KSCAN_MATRIX_WAIT_BETWEEN_OUTPUTS > 0
-        k_busy_wait(CONFIG_MY_KSCAN_MATRIX_WAIT_BETWEEN_OUTPUTS);
-#endif
     }
+#else
+    for (int i = 0; i < lines->len; i++) {
+        const struct kscan_gpio *gpio = &lines->gpios[i];
 
-    for (int col = 0; col < cols->len; col++) {
-        const struct kscan_gpio *col_gpio = &cols->gpios[col];
-        int err = kscan_matrix_init_output_inst(dev, &col_gpio->spec);
+        const int err = kscan_matrix_drive_line(dev, &gpio->spec, value);
         if (err) {
-            LOG_ERR("Failed to set output %i inactive: %i", col_gpio->index, err);
+            LOG_ERR("Failed to set output %i to %d: %i", gpio->index, value, err);
             return err;
         }
-
-#if CONFIG_MY_KSCAN_MATRIX_WAIT_BEFORE_INPUTS > 0
-        k_busy_wait(CONFIG_MY_KSCAN_MATRIX_WAIT_BEFORE_INPUTS);
+    }
 #endif
-        struct kscan_gpio_port_state state = {0};
 
-        for (int row = 0; row < rows->len; row++) {
-            const struct kscan_gpio *row_gpio = &rows->gpios[row];
+    return 0;
+}
 
-            const int index = MATRIX_COLS * row + (col + MATRIX_COLS / 2);
-            const int active = my_kscan_gpio_pin_get(row_gpio, &state);
-            if (active < 0) {
-                LOG_ERR("Failed to read port %s: %i", row_gpio->spec.port->name, active);
-                return active;
-            }
-            if (active) {
-                LOG_INF("2 - Index %i, row %i col %i active %i, pins %d and %d", index, row,
-                col + MATRIX_COLS / 2, active, row_gpio->index, col_gpio->index);
-            }
-            zmk_debounce_update(&data->matrix_state[index], active, config->debounce_scan_period_ms,
-                                &config->debounce_config);
-        }
+static int kscan_matrix_interrupt_configure(const struct kscan_matrix_lines *lines,
+                                            const gpio_flags_t flags) {
+    for (int i = 0; i < lines->len; i++) {
+        const struct gpio_dt_spec *gpio = &lines->gpios[i].spec;
 
-        err = set_pin_as_input(&col_gpio->spec);
+        int err = gpio_pin_interrupt_configure_dt(gpio, flags);
         if (err) {
-            LOG_ERR("Failed to set output %i inactive: %i", col_gpio->index, err);
+            LOG_ERR("Unable to configure interrupt for pin %u on %s", gpio->pin, gpio->port->name);
             return err;
         }
-
-#if CONFIG_MY_KSCAN_MATRIX_WAIT_BETWEEN_OUTPUTS > 0
-        k_busy_wait(CONFIG_MY_KSCAN_MATRIX_WAIT_BETWEEN_OUTPUTS);
-#endif
     }
 
-    // Process the new state.
-    bool continue_scan = false;
+    return 0;
+}
+
+#if USE_QUARANTINE
+/**
+ * Release the drive line of every quarantined key in one half, so a stuck key
+ * cannot hold the level interrupt. The other keys on those lines lose wake
+ * until the slow check scan finds the stuck key released.
+ */
+static int kscan_matrix_release_quarantined(const struct device *dev,
+                                            const enum kscan_diode_direction half,
+                                            const struct kscan_matrix_lines *drive) {
+    const struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    for (int w = 0; w < config->core.key_words; w++) {
+        uint32_t keys = data->core.quarantine[w];
 
-    for (int r = 0; r < config->rows; r++) {
-        for (int c = 0; c < config->cols * 2; c++) {
-            const int index = r * config->cols * 2 + c;
-            struct zmk_debounce_state *state = &data->matrix_state[index];
+        while (keys) {
+            const int key = w * MY_KSCAN_DEBOUNCE_WORD_BITS + find_lsb_set(keys) - 1;
+            const int row = key / config->core.row_keys;
+            const int col = key % config->core.row_keys;
 
-            if (zmk_debounce_get_changed(state)) {
-                const bool pressed = zmk_debounce_is_pressed(state);
+            keys &= keys - 1;
 
-                LOG_DBG("Sending event at %i,%i state %s", r, c, pressed ? "on" : "off");
-                data->callback(dev, r, c, pressed);
+            // Direct keys have no drive line, see kscan_matrix_set_direct_armed().
+            if (row >= config->rows || (col < config->cols) != (half == KSCAN_ROW2COL)) {
+                continue;
             }
 
-            continue_scan = continue_scan || zmk_debounce_is_active(state);
+            const struct kscan_gpio *gpio =
+                &drive->gpios[half == KSCAN_ROW2COL ? row : col - config->cols];
+            const int err = kscan_matrix_drive_line(dev, &gpio->spec, false);
+            if (err) {
+                LOG_ERR("Failed to release quarantined line %i: %i", gpio->index, err);
+                return err;
+            }
         }
     }
 
-    if (continue_scan) {
-        // At least one key is pressed or the debouncer has not yet decided if
-        // it is pressed. Poll quickly until everything is released.
-        kscan_matrix_read_continue(dev);
-    } else {
-        // All keys are released. Return to normal.
+    return 0;
+}
+#endif
+
+#if USE_SHIFT_REGISTER
+/**
+ * Drive every shift register output for wake, except the lines of
+ * quarantined keys. The transfer may sleep, so this runs before the arm lock
+ * is taken rather than from kscan_matrix_set_armed().
+ */
+static int kscan_matrix_shift_arm(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    int err = kscan_matrix_shift_wait(dev);
+    if (err) {
+        return err;
+    }
+
+    for (int line = 0; line < config->rows; line++) {
+        kscan_matrix_shift_set(dev, line, true);
+    }
+
+#if USE_QUARANTINE
+    // A stuck key would hold the level interrupt.
+    for (int w = 0; w < config->core.key_words; w++) {
+        for (uint32_t keys = data->core.quarantine[w]; keys; keys &= keys - 1) {
+            const int key = w * MY_KSCAN_DEBOUNCE_WORD_BITS + find_lsb_set(keys) - 1;
+            const int line = key / config->core.row_keys;
+
+            // Direct keys have no drive line.
+            if (line < config->rows) {
+                kscan_matrix_shift_set(dev, line, false);
+            }
+        }
+    }
+#endif
+
+    data->shift_line = KSCAN_MATRIX_SHIFT_ARMED;
+
+    err = kscan_matrix_shift_send(dev);
+    if (!err) {
+        err = kscan_matrix_shift_wait(dev);
+    }
+
+    return err;
+}
+#endif
+
+/**
+ * Arm or disarm one half of the duplex matrix for wake. The row2col half is
+ * armed by driving every row and sensing the columns, the col2row half the
+ * other way around.
+ */
+static int kscan_matrix_set_armed(const struct device *dev, const enum kscan_diode_direction half,
+                                  const bool armed) {
+    const struct kscan_matrix_config *config = dev->config;
+
+    if (kscan_matrix_shifter(dev)) {
+        // The outputs are driven by kscan_matrix_shift_arm(). Disarming leaves
+        // them for the next scan to replace, so the GPIO interrupt needs no
+        // SPI transfer.
+        return kscan_matrix_interrupt_configure(config->row_lines, armed ? GPIO_INT_LEVEL_ACTIVE
+                                                                         : GPIO_INT_DISABLE);
+    }
+
+    if (!config->col_lines) {
+        return 0;
+    }
+
+    const struct kscan_matrix_lines *drive =
+        half == KSCAN_ROW2COL ? config->row_lines : config->col_lines;
+    const struct kscan_matrix_lines *sense =
+        half == KSCAN_ROW2COL ? config->col_lines : config->row_lines;
+
+    if (!armed) {
+        int err = kscan_matrix_interrupt_configure(sense, GPIO_INT_DISABLE);
+        if (err) {
+            return err;
+        }
+
+        return kscan_matrix_set_all_lines(dev, drive, 0);
+    }
+
+    // Drive first so a key held in this half raises the level interrupt as
+    // soon as it is enabled.
+    int err = kscan_matrix_set_all_lines(dev, drive, 1);
+    if (err) {
+        return err;
+    }
+
+#if USE_QUARANTINE
+    err = kscan_matrix_release_quarantined(dev, half, drive);
+    if (err) {
+        return err;
+    }
+#endif
+
+    return kscan_matrix_interrupt_configure(sense, GPIO_INT_LEVEL_ACTIVE);
+}
+
+/**
+ * Enable or disable the wake interrupt of every direct pin. These need no
+ * drive, so they stay armed while the two halves of the matrix take turns.
+ */
+static int kscan_matrix_set_direct_armed(const struct device *dev, const bool armed) {
+    const struct kscan_matrix_config *config = dev->config;
+    const struct kscan_matrix_lines *direct = config->direct_lines;
+
+    if (!direct || USE_DIRECT_POLLING) {
+        return 0;
+    }
+
+    for (int i = 0; i < direct->len; i++) {
+        const struct gpio_dt_spec *gpio = &direct->gpios[i].spec;
+        gpio_flags_t flags = armed ? GPIO_INT_LEVEL_ACTIVE : GPIO_INT_DISABLE;
+
+#if USE_QUARANTINE
+        const struct kscan_matrix_data *data = dev->data;
+
+        // A stuck key would hold the level interrupt.
+        if (my_kscan_core_is_quarantined(&data->core, config->direct_key + i)) {
+            flags = GPIO_INT_DISABLE;
+        }
+#endif
+
+        int err = gpio_pin_interrupt_configure_dt(gpio, flags);
+        if (err) {
+            LOG_ERR("Unable to configure interrupt for pin %u on %s", gpio->pin, gpio->port->name);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+#if !USE_BATCHED_DRIVE
+// The lines of batched drive, held only while the matrix waits for wake.
+#define KSCAN_MATRIX_WAKE_FLAGS (GPIO_INPUT | GPIO_OUTPUT_LOW | GPIO_OPEN_SOURCE | GPIO_PULL_DOWN)
+
+/** Return every row and column to an input after kscan_matrix_wake_drive(). */
+static void kscan_matrix_wake_release(const struct device *dev) {
+    const struct kscan_matrix_config *config = dev->config;
+    const struct kscan_matrix_lines *const lists[] = {config->row_lines, config->col_lines};
+
+    for (int l = 0; l < ARRAY_SIZE(lists); l++) {
+        for (int i = 0; i < lists[l]->len; i++) {
+            set_pin_as_input(&lists[l]->gpios[i].spec);
+        }
+    }
+}
+
+/**
+ * Make every row and column an open-source output with a pull-down while the
+ * matrix waits for wake, as batched drive does for good, so the arm timer
+ * swaps halves with port writes. Returns false, with every line back to an
+ * input, if a line is active low or its controller lacks GPIO_OPEN_SOURCE.
+ */
+static bool kscan_matrix_wake_drive(const struct device *dev) {
+    const struct kscan_matrix_config *config = dev->config;
+    const struct kscan_matrix_lines *const lists[] = {config->row_lines, config->col_lines};
+
+    for (int l = 0; l < ARRAY_SIZE(lists); l++) {
+        for (int i = 0; i < lists[l]->len; i++) {
+            if (lists[l]->gpios[i].spec.dt_flags & GPIO_ACTIVE_LOW) {
+                return false;
+            }
+        }
+    }
+
+    for (int l = 0; l < ARRAY_SIZE(lists); l++) {
+        for (int i = 0; i < lists[l]->len; i++) {
+            if (gpio_pin_configure_dt(&lists[l]->gpios[i].spec, KSCAN_MATRIX_WAKE_FLAGS)) {
+                kscan_matrix_wake_release(dev);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+#endif
+
+static void kscan_matrix_toggle_armed(struct kscan_matrix_data *data) {
+    k_spinlock_key_t key = k_spin_lock(&data->arm_lock);
+
+    if (data->armed) {
+        // Both halves put a diode between the same row and column pair in
+        // opposite directions, so no single drive pattern can sense a press in
+        // both. Alternate between them instead; each swap is a few port writes.
+        kscan_matrix_set_armed(data->dev, data->armed_half, false);
+        data->armed_half =
+            data->armed_half == KSCAN_ROW2COL ? KSCAN_COL2ROW : KSCAN_ROW2COL;
+        kscan_matrix_set_armed(data->dev, data->armed_half, true);
+    }
+
+    k_spin_unlock(&data->arm_lock, key);
+}
+
+#if !USE_BATCHED_DRIVE
+static void kscan_matrix_arm_work_handler(struct k_work *work) {
+    struct kscan_matrix_data *data = CONTAINER_OF(work, struct kscan_matrix_data, arm_work);
+
+    kscan_matrix_toggle_armed(data);
+}
+#endif
+
+static void kscan_matrix_arm_timer_handler(struct k_timer *timer) {
+    struct kscan_matrix_data *data = CONTAINER_OF(timer, struct kscan_matrix_data, arm_timer);
+
+#if USE_ENERGY
+    data->stats.arm_toggles++;
+#endif
+
+#if !USE_BATCHED_DRIVE
+    // Without wake drive a swap reconfigures every line, which is left to a thread.
+    if (!data->wake_drive) {
+        k_work_submit(&data->arm_work);
+        return;
+    }
+#endif
+
+    kscan_matrix_toggle_armed(data);
+}
+
+static int kscan_matrix_interrupt_enable(const struct device *dev) {
+    const struct kscan_matrix_config *config = dev->config;
+    struct kscan_matrix_data *data = dev->data;
+
+#if USE_SHIFT_REGISTER
+    if (kscan_matrix_shifter(dev)) {
+        int err = kscan_matrix_shift_arm(dev);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+#if !USE_BATCHED_DRIVE
+    if (config->col_lines && !data->wake_drive) {
+        data->wake_drive = kscan_matrix_wake_drive(dev);
+    }
+#endif
+
+    k_spinlock_key_t key = k_spin_lock(&data->arm_lock);
+
+    int err = kscan_matrix_set_armed(dev, data->armed_half, true);
+    if (!err) {
+        err = kscan_matrix_set_direct_armed(dev, true);
+    }
+    data->armed = !err;
+
+    k_spin_unlock(&data->arm_lock, key);
+
+    if (!err && config->col_lines) {
+        k_timer_start(&data->arm_timer, K_MSEC(config->wake_toggle_period_ms),
+                      K_MSEC(config->wake_toggle_period_ms));
+    }
+
+    return err;
+}
+
+static int kscan_matrix_interrupt_disable(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    int err = 0;
+
+    k_timer_stop(&data->arm_timer);
+#if !USE_BATCHED_DRIVE
+    k_work_cancel(&data->arm_work);
+#endif
+
+    k_spinlock_key_t key = k_spin_lock(&data->arm_lock);
+
+    // Release every line so kscan_matrix_read() can scan them one by one.
+    if (data->armed) {
+        err = kscan_matrix_set_direct_armed(dev, false);
+        if (!err) {
+            err = kscan_matrix_set_armed(dev, data->armed_half, false);
+        }
+        data->armed = false;
+    }
+
+#if !USE_BATCHED_DRIVE
+    if (data->wake_drive) {
+        kscan_matrix_wake_release(dev);
+        data->wake_drive = false;
+    }
+#endif
+
+    k_spin_unlock(&data->arm_lock, key);
+
+    return err;
+}
+
+#if USE_IRQ_SCAN
+static int kscan_matrix_read(const struct device *dev);
+#endif
+
+static void kscan_matrix_irq_callback_handler(const struct device *port, struct gpio_callback *cb,
+                                            const gpio_port_pins_t pin) {
+    struct kscan_matrix_irq_callback *irq_data =
+        CONTAINER_OF(cb, struct kscan_matrix_irq_callback, callback);
+    struct kscan_matrix_data *data = irq_data->dev->data;
+
+    // Disable our interrupts temporarily to avoid re-entry while we scan.
+    kscan_matrix_interrupt_disable(data->dev);
+
+#if USE_STATS
+    data->stats.irq_cycles = k_cycle_get_32();
+    data->stats.irq_pending = true;
+#endif
+
+    data->scan_time_us = kscan_matrix_now_us();
+
+#if USE_IRQ_SCAN
+    // Take the first sample at the edge rather than after a context switch.
+    // SPI transfers cannot run here, so a shift register matrix defers it.
+    if (!kscan_matrix_shifter(data->dev)) {
+        kscan_matrix_read(data->dev);
+        return;
+    }
+#endif
+
+    kscan_matrix_schedule(data, K_NO_WAIT);
+}
+
+static int kscan_matrix_init_irqs(const struct device *dev,
+                                  const struct kscan_matrix_lines *lines,
+                                  struct kscan_matrix_irq_callback *irqs) {
+    for (int i = 0; i < lines->len; i++) {
+        const struct kscan_matrix_port *port = &lines->ports[i];
+        if (!port->mask) {
+            continue;
+        }
+
+        struct kscan_matrix_irq_callback *irq = &irqs[i];
+
+        irq->dev = dev;
+        gpio_init_callback(&irq->callback, kscan_matrix_irq_callback_handler, port->mask);
+        int err = gpio_add_callback(port->port, &irq->callback);
+        if (err) {
+            LOG_ERR("Error adding the callback to the input device: %i", err);
+            return err;
+        }
+    }
+
+    return 0;
+}
+#endif // USE_INTERRUPTS
+
+static void kscan_matrix_read_continue(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+
+    kscan_matrix_advance(data, kscan_matrix_cadence_us(dev, false));
+
+    kscan_matrix_schedule(data, K_TIMEOUT_ABS_US(data->scan_time_us));
+}
+
+static void kscan_matrix_read_end(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+
+#if USE_ENERGY
+    if (data->stats.last_raw_us) {
+        data->stats.tail_us += kscan_matrix_now_us() - data->stats.last_raw_us;
+        data->stats.last_raw_us = 0;
+    }
+#endif
+
+#if USE_INTERRUPTS
+    // The next interrupt starts a burst of activity at the fastest period.
+    data->cadence_step = 0;
+    data->quiet_scans = 0;
+
+    uint32_t check_us = 0;
+
+#if USE_QUARANTINE
+    if (data->core.quarantined_keys) {
+        // Quarantined keys cannot raise an interrupt, so look for their release slowly.
+        check_us = CONFIG_ZMK_MY_KSCAN_QUARANTINE_CHECK_MS * USEC_PER_MSEC;
+    }
+#endif
+
+    const struct kscan_matrix_config *config = dev->config;
+    const bool direct_polled = USE_DIRECT_POLLING && config->direct_lines;
+
+    // Charlieplexed and polled direct pins have no interrupt either, so run full scans.
+    const bool charlieplexed = !config->col_lines && !kscan_matrix_shifter(dev);
+    const uint32_t poll_us = kscan_matrix_period_us(dev, config->scan_periods_len);
+
+    if ((charlieplexed || direct_polled) && (!check_us || poll_us < check_us)) {
+        check_us = poll_us;
+    }
+
+    if (check_us) {
+        data->scan_time_us = kscan_matrix_now_us() + check_us;
+        kscan_matrix_schedule(data, K_TIMEOUT_ABS_US(data->scan_time_us));
+    }
+
+    // Return to waiting for an interrupt. Arm last: the interrupt may run or
+    // schedule the next scan at once, and nothing here may replace that.
+    kscan_matrix_interrupt_enable(dev);
+#else
+    kscan_matrix_advance(data, kscan_matrix_cadence_us(dev, true));
+
+    // Return to polling, slowing down towards the poll period.
+    kscan_matrix_schedule(data, K_TIMEOUT_ABS_US(data->scan_time_us));
+#endif
+}
+
+#if !USE_BATCHED_DRIVE
+static int set_pin_as_input(const struct gpio_dt_spec *pin) {
+    int err = gpio_pin_configure_dt(pin, GPIO_INPUT | GPIO_PULL_DOWN);
+    if (err) {
+        LOG_ERR("Unable to configure pin %u on %s for input", pin->pin, pin->port->name);
+        return err;
+    }
+
+    // LOG_DBG("Configured pin %u on %s for input", pin->pin, pin->port->name);
+
+    return 0;
+}
+
+static int kscan_matrix_init_output_inst(const struct device *dev,
+                                        const struct gpio_dt_spec *gpio) {
+    if (!device_is_ready(gpio->port)) {
+        LOG_ERR("GPIO is not ready: %s", gpio->port->name);
+        return -ENODEV;
+    }
+
+    int err = gpio_pin_configure_dt(gpio, GPIO_OUTPUT_HIGH);
+    if (err) {
+        LOG_ERR("Unable to configure pin %u on %s for output", gpio->pin, gpio->port->name);
+        return err;
+    }
+
+    // LOG_DBG("Configured pin %u on %s for output", gpio->pin, gpio->port->name);
+
+    return 0;
+}
+#endif
+
+static int kscan_matrix_drive_line(const struct device *dev, const struct gpio_dt_spec *gpio,
+                                   const bool active) {
+#if USE_BATCHED_DRIVE
+    // Every line is an open-source output, so driving it is only a port write.
+    return active ? gpio_port_set_bits_raw(gpio->port, BIT(gpio->pin))
+                  : gpio_port_clear_bits_raw(gpio->port, BIT(gpio->pin));
+#else
+#if USE_INTERRUPTS
+    const struct kscan_matrix_data *data = dev->data;
+
+    if (data->wake_drive) {
+        return active ? gpio_port_set_bits_raw(gpio->port, BIT(gpio->pin))
+                      : gpio_port_clear_bits_raw(gpio->port, BIT(gpio->pin));
+    }
+#endif
+
+    return active ? kscan_matrix_init_output_inst(dev, gpio) : set_pin_as_input(gpio);
+#endif
+}
+
+/** True if the current scan drives phase i. */
+static inline bool kscan_matrix_phase_due(const struct device *dev, const int i) {
+#if USE_PARTIAL_SCAN
+    const struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+    const int swept = (i - data->sweep_start + config->phases_len) % config->phases_len;
+
+    return swept < data->sweep_len || (data->hot_phases[i / 32] & BIT(i % 32));
+#else
+    return true;
+#endif
+}
+
+#if USE_SHIFT_REGISTER
+/** Next phase after phase i that the current scan drives, or KSCAN_MATRIX_SHIFT_NONE. */
+static int kscan_matrix_next_phase(const struct device *dev, const int i) {
+    const struct kscan_matrix_config *config = dev->config;
+
+    for (int j = i + 1; j < config->phases_len; j++) {
+        if (kscan_matrix_phase_due(dev, j)) {
+            return j;
+        }
+    }
+
+    return KSCAN_MATRIX_SHIFT_NONE;
+}
+#endif
+
+/** Index of the line a phase drives, for logging. */
+static inline int kscan_matrix_phase_line(const struct device *dev,
+                                          const struct kscan_matrix_phase *phase) {
+    const struct kscan_matrix_config *config = dev->config;
+
+    return phase->drive ? phase->drive->index : phase - config->phases;
+}
+
+/**
+ * Drive or release the line of a phase. Releasing a shift register output
+ * starts shifting out the line of the next due phase instead, so one transfer
+ * per phase both releases this line and drives the next.
+ */
+static int kscan_matrix_drive_phase(const struct device *dev,
+                                    const struct kscan_matrix_phase *phase, const bool active) {
+#if USE_SHIFT_REGISTER
+    if (kscan_matrix_shifter(dev)) {
+        struct kscan_matrix_data *data = dev->data;
+        const struct kscan_matrix_config *config = dev->config;
+        const int line = phase - config->phases;
+
+        if (!active) {
+            return kscan_matrix_shift_drive(dev, kscan_matrix_next_phase(dev, line));
+        }
+
+        if (data->shift_line != line) {
+            const int err = kscan_matrix_shift_drive(dev, line);
+            if (err) {
+                return err;
+            }
+        }
+
+        return kscan_matrix_shift_wait(dev);
+    }
+#endif
+
+    return kscan_matrix_drive_line(dev, &phase->drive->spec, active);
+}
+
+/** Feed the raw state of one key read by the current scan to the debouncer and the raw frames. */
+static inline void kscan_matrix_sample(const struct device *dev, const int key, const bool active) {
+    struct kscan_matrix_data *data = dev->data;
+
+#if USE_TRACE
+    if (data->trace_keys) {
+        data->trace_keys[key / MY_KSCAN_DEBOUNCE_WORD_BITS] |=
+            (uint32_t)active << (key % MY_KSCAN_DEBOUNCE_WORD_BITS);
+    }
+#endif
+
+#if USE_SNAPSHOT
+    data->scan_raw[key / MY_KSCAN_DEBOUNCE_WORD_BITS] |=
+        (uint32_t)active << (key % MY_KSCAN_DEBOUNCE_WORD_BITS);
+#endif
+
+#if USE_ENERGY
+    data->stats.raw_pressed |= active;
+#endif
+
+    my_kscan_core_sample(&data->core, kscan_matrix_core_config(dev), key, active);
+}
+
+/** Busy wait for the lines of a phase to settle. */
+static inline void kscan_matrix_settle_wait(struct kscan_matrix_data *data, const uint32_t us) {
+    k_busy_wait(us);
+
+#if USE_ENERGY
+    data->stats.settle_us += us;
+#endif
+}
+
+/**
+ * Drive one line and sample every line of the opposite list with one read per
+ * port, then feed each sensed bit to the debouncer of its key.
+ */
+static int kscan_matrix_scan_phase(const struct device *dev,
+                                   const struct kscan_matrix_phase *phase) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_lines *sense = phase->sense;
+
+    int err = kscan_matrix_drive_phase(dev, phase, true);
+    if (err) {
+        LOG_ERR("Failed to set output %i active: %i", kscan_matrix_phase_line(dev, phase), err);
+        return err;
+    }
+
+#if USE_ENERGY
+    const uint32_t driven = k_cycle_get_32();
+#endif
+
+#if USE_SETTLE_CALIBRATION
+    const struct kscan_matrix_config *config = dev->config;
+    const struct kscan_matrix_settle *settle = &data->settle[phase - config->phases];
+
+    kscan_matrix_settle_wait(data, settle->before_inputs_us);
+#elif CONFIG_ZMK_MY_KSCAN_MATRIX_WAIT_BEFORE_INPUTS > 0
+    kscan_matrix_settle_wait(data, CONFIG_ZMK_MY_KSCAN_MATRIX_WAIT_BEFORE_INPUTS);
+#endif
+
+    const int read_err = kscan_matrix_read_ports(sense, data->port_values);
+
+    err = kscan_matrix_drive_phase(dev, phase, false);
+    if (err) {
+        LOG_ERR("Failed to set output %i inactive: %i", kscan_matrix_phase_line(dev, phase), err);
+        return err;
+    }
+
+#if USE_ENERGY
+    data->stats.drive_us += k_cyc_to_us_floor32(k_cycle_get_32() - driven);
+#endif
+
+    if (read_err) {
+        return read_err;
+    }
+
+    for (int i = 0; i < sense->len; i++) {
+        const struct kscan_matrix_sense *line = &sense->sense[i];
+        const bool active = (data->port_values[line->port] & BIT(line->pin)) != 0;
+        const uint16_t key = phase->keys[i];
+
+        if (key != KSCAN_MATRIX_NO_KEY) {
+            kscan_matrix_sample(dev, key, active);
+        }
+    }
+
+#if USE_SETTLE_CALIBRATION
+    kscan_matrix_settle_wait(data, settle->between_outputs_us);
+#elif CONFIG_ZMK_MY_KSCAN_MATRIX_WAIT_BETWEEN_OUTPUTS > 0
+    kscan_matrix_settle_wait(data, CONFIG_ZMK_MY_KSCAN_MATRIX_WAIT_BETWEEN_OUTPUTS);
+#endif
+
+    return 0;
+}
+
+/** Sample every direct pin with one read per port. These need no drive and no settle time. */
+static int kscan_matrix_scan_direct(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+    const struct kscan_matrix_lines *direct = config->direct_lines;
+
+    int err = kscan_matrix_read_ports(direct, data->port_values);
+    if (err) {
+        return err;
+    }
+
+    for (int i = 0; i < direct->len; i++) {
+        const struct kscan_matrix_sense *line = &direct->sense[i];
+        // Raw reads ignore the devicetree polarity, which direct pins are free to use.
+        const bool active_low = (direct->gpios[i].spec.dt_flags & GPIO_ACTIVE_LOW) != 0;
+        const bool level = (data->port_values[line->port] & BIT(line->pin)) != 0;
+
+        kscan_matrix_sample(dev, config->direct_key + i, level != active_low);
+    }
+
+    return 0;
+}
+
+static void kscan_matrix_send_event(void *context, const uint32_t row, const uint32_t column,
+                                    const bool pressed) {
+    const struct device *dev = context;
+    struct kscan_matrix_data *data = dev->data;
+
+    LOG_DBG("Sending event at %i,%i state %s", row, column, pressed ? "on" : "off");
+    if (data->callback) {
+        data->callback(dev, row, column, pressed);
+    }
+
+#if USE_STATS
+    data->stats.events++;
+#if USE_ENERGY
+    data->stats.presses += pressed;
+#endif
+    if (pressed && data->stats.press_pending) {
+        data->stats.press_pending = false;
+        my_kscan_histogram_add(&data->stats.press,
+                               k_cyc_to_us_floor32(k_cycle_get_32() - data->stats.press_cycles));
+    }
+#endif
+}
+
+#if USE_QUARANTINE
+/**
+ * Once the pressed keys have all been held without a change for the
+ * quarantine time, treat them as stuck so they stop keeping the matrix
+ * active.
+ */
+static void kscan_matrix_check_stuck(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    struct my_kscan_core *core = &data->core;
+
+    if (!my_kscan_core_is_active(core) || my_kscan_core_is_settling(core) ||
+        core->changed_words) {
+        data->quiet_since_us = data->scan_time_us;
+        return;
+    }
+
+    if (data->scan_time_us - data->quiet_since_us >=
+        CONFIG_ZMK_MY_KSCAN_QUARANTINE_AFTER_MS * USEC_PER_MSEC) {
+        const uint32_t keys = my_kscan_core_quarantine_held(core, kscan_matrix_core_config(dev));
+
+        LOG_WRN("%s: %u keys held for %d ms, quarantined", dev->name, keys,
+                CONFIG_ZMK_MY_KSCAN_QUARANTINE_AFTER_MS);
+    }
+}
+#endif
+
+/**
+ * Debounce the scan that just completed. With snapshots enabled, the new
+ * pressed state and raw frame are published together under the sequence
+ * count.
+ */
+static void kscan_matrix_finish(const struct device *dev, const int64_t start_us) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct my_kscan_core_config *core_config = kscan_matrix_core_config(dev);
+
+#if USE_SNAPSHOT
+    uint32_t *previous_raw = data->snapshot_raw;
+    k_spinlock_key_t key = k_spin_lock(&data->snapshot_lock);
+
+    atomic_inc(&data->snapshot_seq);
+    my_kscan_core_finish(&data->core, core_config);
+    data->snapshot_raw = data->scan_raw;
+    data->snapshot_time_us = start_us;
+    atomic_inc(&data->snapshot_seq);
+
+    k_spin_unlock(&data->snapshot_lock, key);
+
+    // Anyone still reading the previous frame sees the count change and retries.
+    memset(previous_raw, 0, core_config->key_words * sizeof(uint32_t));
+    data->scan_raw = previous_raw;
+#else
+    my_kscan_core_finish(&data->core, core_config);
+#endif
+}
+
+#if USE_PARTIAL_SCAN
+/**
+ * Pick the phases swept by this scan. While keys are held, sweep just enough
+ * phases per scan at the current period to read every phase within the
+ * latency bound. Otherwise sweep them all.
+ */
+static void kscan_matrix_plan_sweep(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    data->sweep_start = (data->sweep_start + data->sweep_len) % config->phases_len;
+
+    if (!my_kscan_core_is_active(&data->core)) {
+        data->sweep_len = config->phases_len;
+        return;
+    }
+
+    const uint32_t period_us = kscan_matrix_period_us(dev, data->cadence_step);
+
+    data->sweep_len = CLAMP(DIV_ROUND_UP(config->phases_len * period_us,
+                                         CONFIG_ZMK_MY_KSCAN_PARTIAL_SCAN_LATENCY_US),
+                            1, config->phases_len);
+}
+
+/** Recompute which of the phases just scanned have active keys. */
+static void kscan_matrix_update_hot(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    for (int i = 0; i < config->phases_len; i++) {
+        const struct kscan_matrix_phase *phase = &config->phases[i];
+        bool hot = false;
+
+        if (!kscan_matrix_phase_due(dev, i)) {
+            continue;
+        }
+
+        for (int j = 0; j < phase->sense->len && !hot; j++) {
+            const uint16_t key = phase->keys[j];
+
+            // Keys that are not driven sample as released, so a quarantined key must stay hot too.
+            hot = key != KSCAN_MATRIX_NO_KEY && my_kscan_core_key_is_active(&data->core, key);
+        }
+
+        WRITE_BIT(data->hot_phases[i / 32], i % 32, hot);
+    }
+}
+#endif // USE_PARTIAL_SCAN
+
+#if USE_TUNING
+static void kscan_matrix_apply_tuning(const struct device *dev);
+#endif
+
+static int kscan_matrix_read(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+#if USE_INTERRUPTS
+    // A slow check of lines without wake runs while the matrix is armed.
+    if (data->armed) {
+        kscan_matrix_interrupt_disable(dev);
+    }
+#endif
+
+#if USE_TUNING
+    kscan_matrix_apply_tuning(dev);
+#endif
+
+    const int64_t start_us = kscan_matrix_now_us();
+    const int64_t lateness = start_us - data->scan_time_us;
+    if (lateness > data->max_lateness_us) {
+        data->max_lateness_us = lateness;
+    }
+
+#if USE_STATS
+    struct kscan_matrix_stats *stats = &data->stats;
+    const uint32_t scan_start = k_cycle_get_32();
+    const bool was_idle = !my_kscan_core_is_active(&data->core);
+    uint32_t wake_cycles = scan_start;
+
+#if USE_ENERGY
+    if (was_idle && !stats->irq_pending) {
+        stats->poll_wakes++;
+    }
+    stats->raw_pressed = false;
+#endif
+
+    if (stats->irq_pending) {
+        stats->irq_pending = false;
+        wake_cycles = stats->irq_cycles;
+        my_kscan_histogram_add(&stats->irq, k_cyc_to_us_floor32(scan_start - wake_cycles));
+    }
+    my_kscan_histogram_add(&stats->lateness, lateness);
+
+    uint32_t half_start = scan_start;
+#endif
+
+#if USE_TRACE
+    data->trace_keys = my_kscan_trace_begin(&data->trace);
+#endif
+
+#if USE_PARTIAL_SCAN
+    kscan_matrix_plan_sweep(dev);
+#endif
+
+    for (int i = 0; i < config->phases_len; i++) {
+        if (kscan_matrix_phase_due(dev, i)) {
+            int err = kscan_matrix_scan_phase(dev, &config->phases[i]);
+            if (err) {
+                return err;
+            }
+        }
+
+#if USE_STATS
+        // Phases drive every row, then every column.
+        if (i == config->rows - 1 || i == config->phases_len - 1) {
+            const uint32_t now = k_cycle_get_32();
+
+            my_kscan_histogram_add(&stats->half[i == config->rows - 1 ? KSCAN_ROW2COL
+                                                                      : KSCAN_COL2ROW],
+                                   k_cyc_to_us_floor32(now - half_start));
+            half_start = now;
+        }
+#endif
+    }
+
+    if (config->direct_lines) {
+        int err = kscan_matrix_scan_direct(dev);
+        if (err) {
+            return err;
+        }
+    }
+
+#if USE_ENERGY
+    if (stats->raw_pressed) {
+        stats->last_raw_us = start_us;
+    }
+#endif
+
+#if USE_TRACE
+    if (data->trace_keys) {
+        my_kscan_trace_commit(&data->trace, data->trace_keys,
+                              (uint32_t)k_ticks_to_us_floor64(k_uptime_ticks()));
+        data->trace_keys = NULL;
+    }
+#endif
+
+    kscan_matrix_finish(dev, start_us);
+
+#if USE_QUARANTINE
+    kscan_matrix_check_stuck(dev);
+#endif
+
+#if USE_PARTIAL_SCAN
+    kscan_matrix_update_hot(dev);
+#endif
+
+#if USE_STATS
+    if (was_idle && my_kscan_core_is_active(&data->core)) {
+        stats->press_cycles = wake_cycles;
+        stats->press_pending = true;
+    }
+#endif
+
+    if (data->frame_callback && data->core.changed_words) {
+        const struct my_kscan_frame frame = {
+            .timestamp_us = start_us,
+            .changed = data->core.changed_keys,
+            .pressed = data->core.pressed_keys,
+            .words = config->core.key_words,
+            .row_keys = config->core.row_keys,
+        };
+
+        data->frame_callback(dev, &frame);
+    }
+
+    my_kscan_core_dispatch(&data->core, kscan_matrix_core_config(dev), kscan_matrix_send_event,
+                           (void *)dev);
+
+#if USE_STATS
+    if (!my_kscan_core_is_active(&data->core)) {
+        // The keys seen since the matrix was last idle bounced without a press.
+        stats->press_pending = false;
+    }
+
+    stats->scans++;
+    my_kscan_histogram_add(&stats->scan, k_cyc_to_us_floor32(k_cycle_get_32() - scan_start));
+
+#if IS_ENABLED(CONFIG_STATS)
+    STATS_SET(stats->group, scans, stats->scans);
+    STATS_SET(stats->group, events, stats->events);
+    STATS_SET(stats->group, overruns, data->overruns);
+    STATS_SET(stats->group, max_scan_us, stats->scan.max);
+    STATS_SET(stats->group, max_irq_us, stats->irq.max);
+    STATS_SET(stats->group, max_press_us, stats->press.max);
+    STATS_SET(stats->group, irq_wakes, stats->irq.count);
+#if USE_ENERGY
+    STATS_SET(stats->group, poll_wakes, stats->poll_wakes);
+    STATS_SET(stats->group, arm_toggles, stats->arm_toggles);
+    STATS_SET(stats->group, presses, stats->presses);
+    STATS_SET(stats->group, settle_ms, stats->settle_us / USEC_PER_MSEC);
+    STATS_SET(stats->group, drive_ms, stats->drive_us / USEC_PER_MSEC);
+    STATS_SET(stats->group, tail_ms, stats->tail_us / USEC_PER_MSEC);
+    STATS_SET(stats->group, resumes, stats->resumes);
+#endif
+#endif
+#endif
+
+    const bool continue_scan = my_kscan_core_is_active(&data->core);
+
+    if (continue_scan) {
+        // At least one key is pressed or the debouncer has not yet decided if
+        // it is pressed. Poll quickly until everything is released.
+        kscan_matrix_read_continue(dev);
+    } else {
+        // All keys are released. Return to normal.
         kscan_matrix_read_end(dev);
     }
 
     return 0;
 }
 
-static void kscan_matrix_work_handler(struct k_work *work) {
-    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
-    struct kscan_matrix_data *data = CONTAINER_OF(dwork, struct kscan_matrix_data, work);
-    kscan_matrix_read(data->dev);
+#if USE_SCAN_THREAD
+static void kscan_matrix_thread(void *p1, void *p2, void *p3) {
+    const struct device *dev = p1;
+    struct kscan_matrix_data *data = dev->data;
+
+    while (true) {
+        k_sem_take(&data->scan_sem, K_FOREVER);
+        kscan_matrix_read(dev);
+    }
+}
+#elif USE_COORDINATOR
+static void kscan_matrix_coordinator_handler(struct k_work *work) {
+    const int64_t now = kscan_matrix_now_us();
+
+    for (int i = 0; i < kscan_matrix_coordinated_len; i++) {
+        const struct device *dev = kscan_matrix_coordinated[i];
+        struct kscan_matrix_data *data = dev->data;
+        k_spinlock_key_t key = k_spin_lock(&kscan_matrix_coordinator_lock);
+
+        const bool due = data->scan_pending &&
+                         data->scan_time_us <= now + CONFIG_ZMK_MY_KSCAN_COORDINATOR_WINDOW_US;
+        if (due) {
+            data->scan_pending = false;
+            // Later deadlines step from this pass, which keeps the matrices aligned.
+            data->scan_time_us = MIN(data->scan_time_us, now);
+        }
+
+        k_spin_unlock(&kscan_matrix_coordinator_lock, key);
+
+        if (due) {
+            kscan_matrix_read(dev);
+        }
+    }
+
+    // Each scan rescheduled itself, but a pass that found nothing due must reschedule too.
+    k_spinlock_key_t key = k_spin_lock(&kscan_matrix_coordinator_lock);
+    kscan_matrix_coordinate();
+    k_spin_unlock(&kscan_matrix_coordinator_lock, key);
+}
+#else
+static void kscan_matrix_work_handler(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct kscan_matrix_data *data = CONTAINER_OF(dwork, struct kscan_matrix_data, work);
+    kscan_matrix_read(data->dev);
+}
+#endif
+
+static int kscan_matrix_configure(const struct device *dev, const kscan_callback_t callback) {
+    struct kscan_matrix_data *data = dev->data;
+
+    if (!callback) {
+        return -EINVAL;
+    }
+
+    data->callback = callback;
+    return 0;
+}
+
+int my_kscan_configure_frame(const struct device *dev, my_kscan_frame_callback_t callback) {
+    struct kscan_matrix_data *data = dev->data;
+
+    data->frame_callback = callback;
+    return 0;
+}
+
+#if USE_SNAPSHOT
+uint32_t my_kscan_snapshot_begin(const struct device *dev, struct my_kscan_snapshot *snapshot) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+    uint32_t seq;
+
+    // Only a scan on another CPU can be caught mid-publish.
+    while ((seq = atomic_get(&data->snapshot_seq)) & 1) {
+    }
+
+    snapshot->timestamp_us = data->snapshot_time_us;
+    snapshot->pressed = data->core.pressed_keys;
+    snapshot->raw = data->snapshot_raw;
+    snapshot->words = config->core.key_words;
+    snapshot->row_keys = config->core.row_keys;
+
+    return seq;
+}
+
+bool my_kscan_snapshot_retry(const struct device *dev, uint32_t seq) {
+    struct kscan_matrix_data *data = dev->data;
+
+    // Finish reading the snapshot before checking whether it changed.
+    barrier_dmem_fence_full();
+    return atomic_get(&data->snapshot_seq) != seq;
+}
+#endif
+
+static int kscan_matrix_enable(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+
+    data->scan_time_us = kscan_matrix_now_us();
+    data->cadence_step = 0;
+    data->quiet_scans = 0;
+
+    // Scan from the scan context rather than the caller's, which may be a PM
+    // transition. Read will automatically start interrupts/polling once done.
+    kscan_matrix_schedule(data, K_NO_WAIT);
+    return 0;
+}
+
+static int kscan_matrix_disable(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+
+    kscan_matrix_cancel(data);
+
+#if USE_INTERRUPTS
+    int err = kscan_matrix_interrupt_disable(dev);
+    if (err) {
+        return err;
+    }
+#endif
+
+#if USE_SHIFT_REGISTER
+    // Armed outputs stay driven through a disarm, see kscan_matrix_set_armed().
+    if (kscan_matrix_shifter(dev)) {
+        return kscan_matrix_shift_drive(dev, KSCAN_MATRIX_SHIFT_NONE);
+    }
+#endif
+
+    return 0;
+}
+
+#if USE_BATCHED_DRIVE
+// Keep the input buffer connected while the line is an open-source output:
+// a cleared bit floats the line onto its pull-down, a set bit drives it high.
+#define KSCAN_MATRIX_LINE_FLAGS (GPIO_INPUT | GPIO_OUTPUT_LOW | GPIO_OPEN_SOURCE | GPIO_PULL_DOWN)
+#else
+#define KSCAN_MATRIX_LINE_FLAGS GPIO_INPUT
+#endif
+
+static int kscan_matrix_init_input_inst(const struct device *dev, const struct kscan_gpio *gpio) {
+    if (!device_is_ready(gpio->spec.port)) {
+        LOG_ERR("GPIO is not ready: %s", gpio->spec.port->name);
+        return -ENODEV;
+    }
+
+#if USE_BATCHED_DRIVE
+    // Raw port writes bypass the devicetree polarity, so lines must be active high.
+    if (gpio->spec.dt_flags & GPIO_ACTIVE_LOW) {
+        LOG_ERR("Pin %u on %s must be active high for batched drive", gpio->spec.pin,
+                gpio->spec.port->name);
+        return -ENOTSUP;
+    }
+#endif
+
+    int err = gpio_pin_configure_dt(&gpio->spec, KSCAN_MATRIX_LINE_FLAGS);
+    if (err) {
+        LOG_ERR("Unable to configure pin %u on %s for input", gpio->spec.pin,
+                gpio->spec.port->name);
+        return err;
+    }
+
+    err = gpio_pin_set_dt(&gpio->spec, 0);
+    if (err) {
+        LOG_ERR("Unable to set pin %u on %s to low", gpio->spec.pin, gpio->spec.port->name);
+        return err;
+    }
+
+    // LOG_DBG("Configured pin %u on %s for input", gpio->spec.pin, gpio->spec.port->name);
+
+    return 0;
 }
 
-static int kscan_matrix_configure(const struct device *dev, const kscan_callback_t callback) {
+static int kscan_matrix_init_direct_inst(const struct device *dev, const struct kscan_gpio *gpio) {
+    if (!device_is_ready(gpio->spec.port)) {
+        LOG_ERR("GPIO is not ready: %s", gpio->spec.port->name);
+        return -ENODEV;
+    }
+
+    // Pulls and polarity come from the devicetree flags.
+    int err = gpio_pin_configure_dt(&gpio->spec, GPIO_INPUT);
+    if (err) {
+        LOG_ERR("Unable to configure pin %u on %s for input", gpio->spec.pin,
+                gpio->spec.port->name);
+        return err;
+    }
+
+    return 0;
+}
+
+static int kscan_matrix_init_pins(const struct device *dev) {
+    const struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    for (int i = 0; i < data->inputs.len; i++) {
+        const struct kscan_gpio *gpio = &data->inputs.gpios[i];
+        int err = kscan_matrix_init_input_inst(dev, gpio);
+        if (err) {
+            return err;
+        }
+    }
+
+    for (int i = 0; i < data->outputs.len; i++) {
+        const struct kscan_gpio *gpio = &data->outputs.gpios[i];
+        int err = kscan_matrix_init_input_inst(dev, gpio);
+        if (err) {
+            return err;
+        }
+    }
+
+    for (int i = 0; config->direct_lines && i < config->direct_lines->len; i++) {
+        const struct kscan_gpio *gpio = &config->direct_lines->gpios[i];
+        int err = kscan_matrix_init_direct_inst(dev, gpio);
+        if (err) {
+            return err;
+        }
+    }
+
+#if USE_SHIFT_REGISTER
+    const struct kscan_matrix_shift_register *shifter = kscan_matrix_shifter(dev);
+
+    if (shifter) {
+        if (!spi_is_ready_dt(&shifter->spi)) {
+            LOG_ERR("SPI bus is not ready: %s", shifter->spi.bus->name);
+            return -ENODEV;
+        }
+
+        int err = kscan_matrix_shift_drive(dev, KSCAN_MATRIX_SHIFT_NONE);
+        if (!err) {
+            err = kscan_matrix_shift_wait(dev);
+        }
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/** Add the GPIO callbacks once. They stay registered across suspend and resume. */
+static int kscan_matrix_init_callbacks(const struct device *dev) {
+#if USE_INTERRUPTS
     struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+    int err = 0;
 
-    if (!callback) {
+    // A shift register matrix wakes on its sense lines only.
+    if (config->col_lines || kscan_matrix_shifter(dev)) {
+        err = kscan_matrix_init_irqs(dev, config->row_lines, data->irqs);
+        if (!err && config->col_lines) {
+            err = kscan_matrix_init_irqs(dev, config->col_lines, &data->irqs[config->rows]);
+        }
+        if (err) {
+            return err;
+        }
+    }
+
+    if (config->direct_lines && !USE_DIRECT_POLLING) {
+        const size_t first = config->row_lines->len + (config->col_lines ? config->cols : 0);
+
+        err = kscan_matrix_init_irqs(dev, config->direct_lines, &data->irqs[first]);
+        if (err) {
+            return err;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+#if IS_ENABLED(CONFIG_PM_DEVICE)
+
+static int kscan_matrix_configure_list(const struct kscan_gpio *gpios, const size_t len,
+                                       const gpio_flags_t flags) {
+    for (int i = 0; i < len; i++) {
+        int err = gpio_pin_configure_dt(&gpios[i].spec, flags);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Configure the matrix lines with line_flags and the direct pins with
+ * direct_flags, without the checks of a first setup.
+ */
+static int kscan_matrix_configure_pins(const struct device *dev, const gpio_flags_t line_flags,
+                                       const gpio_flags_t direct_flags) {
+    const struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    int err = kscan_matrix_configure_list(data->inputs.gpios, data->inputs.len, line_flags);
+    if (!err) {
+        err = kscan_matrix_configure_list(data->outputs.gpios, data->outputs.len, line_flags);
+    }
+    if (!err && config->direct_lines) {
+        err = kscan_matrix_configure_list(config->direct_lines->gpios, config->direct_lines->len,
+                                          direct_flags);
+    }
+
+    return err;
+}
+
+static int kscan_matrix_disconnect(const struct device *dev) {
+    return kscan_matrix_configure_pins(dev, GPIO_DISCONNECTED, GPIO_DISCONNECTED);
+}
+
+#endif // IS_ENABLED(CONFIG_PM_DEVICE)
+
+#if USE_SETTLE_CALIBRATION
+/** Fold the sensed bits of every port into one word that changes when any of them does. */
+static uint32_t kscan_matrix_sense_signature(const struct kscan_matrix_lines *lines,
+                                             const gpio_port_value_t *values) {
+    uint32_t signature = 0;
+
+    for (int i = 0; i < lines->len; i++) {
+        const struct kscan_matrix_port *port = &lines->ports[i];
+        if (port->mask) {
+            signature = signature * 31 + (values[i] & port->mask);
+        }
+    }
+
+    return signature;
+}
+
+/**
+ * Drive or release the line of a phase, then poll until the line reads back
+ * at its new level and the sensed ports have settled: unchanged between two
+ * reads after driving, all low after releasing. Stores the time this took
+ * plus the safety margin, capped at the largest allowed wait.
+ */
+static int kscan_matrix_measure_settle(const struct device *dev,
+                                       const struct kscan_matrix_phase *phase, const bool active,
+                                       uint8_t *wait_us) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct gpio_dt_spec *drive = &phase->drive->spec;
+    const uint32_t timeout = k_us_to_cyc_ceil32(CONFIG_ZMK_MY_KSCAN_SETTLE_MAX_US);
+    const uint32_t start = k_cycle_get_32();
+    uint32_t previous = 0;
+    bool have_previous = false;
+    bool settled = false;
+    uint32_t elapsed;
+
+    int err = kscan_matrix_drive_line(dev, drive, active);
+    if (err) {
+        return err;
+    }
+
+    do {
+        gpio_port_value_t drive_value;
+
+        err = gpio_port_get_raw(drive->port, &drive_value);
+        if (!err) {
+            err = kscan_matrix_read_ports(phase->sense, data->port_values);
+        }
+        if (err) {
+            return err;
+        }
+
+        elapsed = k_cycle_get_32() - start;
+
+        const bool at_level = ((drive_value & BIT(drive->pin)) != 0) == active;
+        const uint32_t signature = kscan_matrix_sense_signature(phase->sense, data->port_values);
+
+        if (at_level) {
+            settled = active ? (have_previous && signature == previous) : signature == 0;
+        }
+        previous = signature;
+        have_previous = at_level;
+    } while (!settled && elapsed < timeout);
+
+    if (!settled) {
+        LOG_WRN("Line %i did not settle within %d us", phase->drive->index,
+                CONFIG_ZMK_MY_KSCAN_SETTLE_MAX_US);
+    }
+
+    *wait_us = MIN(k_cyc_to_us_ceil32(elapsed) + CONFIG_ZMK_MY_KSCAN_SETTLE_MARGIN_US,
+                   CONFIG_ZMK_MY_KSCAN_SETTLE_MAX_US);
+    return 0;
+}
+
+static int kscan_matrix_calibrate(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    for (int i = 0; i < config->phases_len; i++) {
+        const struct kscan_matrix_phase *phase = &config->phases[i];
+        struct kscan_matrix_settle *settle = &data->settle[i];
+
+#if USE_SHIFT_REGISTER
+        // Shift register outputs cannot be read back, so keep the fixed waits.
+        if (!phase->drive) {
+            settle->before_inputs_us = MIN(CONFIG_ZMK_MY_KSCAN_MATRIX_WAIT_BEFORE_INPUTS,
+                                           CONFIG_ZMK_MY_KSCAN_SETTLE_MAX_US);
+            settle->between_outputs_us = MIN(CONFIG_ZMK_MY_KSCAN_MATRIX_WAIT_BETWEEN_OUTPUTS,
+                                             CONFIG_ZMK_MY_KSCAN_SETTLE_MAX_US);
+            continue;
+        }
+#endif
+
+        int err = kscan_matrix_measure_settle(dev, phase, true, &settle->before_inputs_us);
+        if (!err) {
+            err = kscan_matrix_measure_settle(dev, phase, false, &settle->between_outputs_us);
+        }
+        if (err) {
+            LOG_ERR("Failed to calibrate line %i: %i", phase->drive->index, err);
+            kscan_matrix_drive_line(dev, &phase->drive->spec, false);
+            return err;
+        }
+
+        LOG_DBG("Line %i settles in %u us, releases in %u us", phase->drive->index,
+                settle->before_inputs_us, settle->between_outputs_us);
+    }
+
+    return 0;
+}
+#endif // USE_SETTLE_CALIBRATION
+
+static int kscan_matrix_setup_pins(const struct device *dev) {
+#if IS_ENABLED(CONFIG_PM_DEVICE)
+    struct kscan_matrix_data *data = dev->data;
+
+    // The pins were checked and the settle times measured on the first resume.
+    // Batched drive lines start low from their flags, so nothing is written.
+    if (data->pins_ready) {
+        const int err = kscan_matrix_configure_pins(dev, KSCAN_MATRIX_LINE_FLAGS, GPIO_INPUT);
+        if (err) {
+            LOG_ERR("Unable to restore the pins of %s", dev->name);
+        }
+        return err;
+    }
+#endif
+
+    int err = kscan_matrix_init_pins(dev);
+    if (err) {
+        return err;
+    }
+
+#if USE_SETTLE_CALIBRATION
+    err = kscan_matrix_calibrate(dev);
+    if (err) {
+        return err;
+    }
+#endif
+
+#if IS_ENABLED(CONFIG_PM_DEVICE)
+    data->pins_ready = true;
+#endif
+
+    return 0;
+}
+
+/** Debounce time in scans at the given scan period. */
+static inline uint32_t kscan_matrix_debounce_ticks(const uint32_t ms, const uint32_t period_us) {
+    return DIV_ROUND_UP(ms * USEC_PER_MSEC, period_us);
+}
+
+#if USE_PACKED_DEBOUNCE
+/** Build the per-key thresholds of debounce-overrides, if the instance has any. */
+static int kscan_matrix_init_debounce(const struct device *dev) {
+    const struct kscan_matrix_config *config = dev->config;
+    const struct my_kscan_core_config *core = kscan_matrix_core_config(dev);
+    const uint32_t period_us = kscan_matrix_period_us(dev, 0);
+
+    if (!core->debounce_planes) {
+        return 0;
+    }
+
+    for (int w = 0; w < core->key_words; w++) {
+        my_kscan_debounce_planes_fill(&core->debounce_planes[w], &core->debounce_config);
+    }
+
+    for (int i = 0; i < config->debounce_overrides_len; i += 4) {
+        const uint32_t *entry = &config->debounce_overrides[i];
+        const uint32_t key = entry[0] * core->row_keys + entry[1];
+        const uint32_t press_ticks = kscan_matrix_debounce_ticks(entry[2], period_us);
+        const uint32_t release_ticks = kscan_matrix_debounce_ticks(entry[3], period_us);
+
+        if (entry[1] >= core->row_keys || key >= core->keys ||
+            MAX(press_ticks, release_ticks) > MY_KSCAN_DEBOUNCE_TICKS_MAX) {
+            LOG_ERR("Invalid debounce override for row %u column %u", entry[0], entry[1]);
+            return -EINVAL;
+        }
+
+        my_kscan_debounce_planes_set(&core->debounce_planes[key / MY_KSCAN_DEBOUNCE_WORD_BITS],
+                                     key % MY_KSCAN_DEBOUNCE_WORD_BITS, press_ticks,
+                                     release_ticks);
+    }
+
+    return 0;
+}
+#endif
+
+// Only tuning changes and the shell reset the statistics.
+#if USE_STATS && (USE_TUNING || IS_ENABLED(CONFIG_SHELL))
+/** Clear the counters and histograms. A scan running meanwhile may leave a sample or two. */
+static void kscan_matrix_stats_clear(struct kscan_matrix_data *data) {
+    struct kscan_matrix_stats *stats = &data->stats;
+
+    memset(stats->half, 0, sizeof(stats->half));
+    memset(&stats->scan, 0, sizeof(stats->scan));
+    memset(&stats->irq, 0, sizeof(stats->irq));
+    memset(&stats->press, 0, sizeof(stats->press));
+    memset(&stats->lateness, 0, sizeof(stats->lateness));
+    stats->scans = 0;
+    stats->events = 0;
+#if USE_ENERGY
+    stats->poll_wakes = 0;
+    stats->arm_toggles = 0;
+    stats->presses = 0;
+    stats->resumes = 0;
+    stats->settle_us = 0;
+    stats->drive_us = 0;
+    stats->tail_us = 0;
+#endif
+    stats->since_ms = k_uptime_get();
+    data->overruns = 0;
+    data->max_lateness_us = 0;
+}
+#endif
+
+#if USE_TUNING
+/** Start from the devicetree parameters, before settings are loaded. */
+static void kscan_matrix_init_tuning(const struct device *dev) {
+    struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_config *config = dev->config;
+
+    data->core_config = config->core;
+    data->tuning = config->tuning;
+    data->tuning_next = config->tuning;
+}
+
+/**
+ * Check tuning against the limits of the debouncer and queue it for the next
+ * scan, which switches every parameter at once before it reads the matrix.
+ */
+static int kscan_matrix_tune(const struct device *dev, const struct kscan_matrix_tuning *tuning) {
+    struct kscan_matrix_data *data = dev->data;
+
+    if (!tuning->scan_period_us || !tuning->poll_period_us) {
         return -EINVAL;
     }
 
-    data->callback = callback;
+    uint32_t ticks = kscan_matrix_debounce_ticks(
+        MAX(tuning->debounce_press_ms, tuning->debounce_release_ms), tuning->scan_period_us);
+
+#if USE_PACKED_DEBOUNCE
+    const struct kscan_matrix_config *config = dev->config;
+
+    for (int i = 0; i < config->debounce_overrides_len; i += 4) {
+        const uint32_t *entry = &config->debounce_overrides[i];
+
+        ticks = MAX(ticks, kscan_matrix_debounce_ticks(MAX(entry[2], entry[3]),
+                                                       tuning->scan_period_us));
+    }
+
+    if (ticks > MY_KSCAN_DEBOUNCE_TICKS_MAX) {
+        return -ERANGE;
+    }
+#else
+    if (ticks > DEBOUNCE_COUNTER_MAX) {
+        return -ERANGE;
+    }
+#endif
+
+    k_spinlock_key_t key = k_spin_lock(&data->tuning_lock);
+    data->tuning_next = *tuning;
+    k_spin_unlock(&data->tuning_lock, key);
+
+    atomic_set(&data->tuning_pending, 1);
     return 0;
 }
 
-static int kscan_matrix_enable(const struct device *dev) {
+#if USE_STATS
+static void kscan_matrix_tuning_report(const struct device *dev,
+                                       struct kscan_matrix_tuning_report *report) {
+    const struct kscan_matrix_data *data = dev->data;
+    const struct kscan_matrix_stats *stats = &data->stats;
+    const int64_t elapsed = k_uptime_get() - stats->since_ms;
+
+    report->tuning = data->tuning;
+    report->seconds = elapsed / MSEC_PER_SEC;
+    report->scans_per_s =
+        elapsed > 0 ? (uint32_t)((uint64_t)stats->scans * MSEC_PER_SEC / elapsed) : 0;
+    report->scan_avg_us = stats->scan.count ? (uint32_t)(stats->scan.sum / stats->scan.count) : 0;
+    report->presses = stats->press.count;
+    report->press_p50_us = my_kscan_histogram_percentile(&stats->press, 50);
+    report->press_p99_us = my_kscan_histogram_percentile(&stats->press, 99);
+#if USE_ENERGY
+    report->scans_per_press = stats->presses ? stats->scans / stats->presses : 0;
+    report->drive_us_per_press = stats->presses ? stats->drive_us / stats->presses : 0;
+#endif
+    report->valid = true;
+}
+#endif
+
+/** Switch to the parameters queued by kscan_matrix_tune(), if any. Runs before a scan. */
+static void kscan_matrix_apply_tuning(const struct device *dev) {
     struct kscan_matrix_data *data = dev->data;
 
-    data->scan_time = k_uptime_get();
+    if (!atomic_cas(&data->tuning_pending, 1, 0)) {
+        return;
+    }
 
-    // Read will automatically start interrupts/polling once done.
-    return kscan_matrix_read(dev);
-}
+    k_spinlock_key_t key = k_spin_lock(&data->tuning_lock);
+    const struct kscan_matrix_tuning tuning = data->tuning_next;
+    k_spin_unlock(&data->tuning_lock, key);
 
-static int kscan_matrix_disable(const struct device *dev) {
-    struct kscan_matrix_data *data = dev->data;
+#if USE_STATS
+    // Keep what the outgoing parameters measured and start afresh for the new ones.
+    kscan_matrix_tuning_report(dev, &data->tuning_before);
+    kscan_matrix_stats_clear(data);
+#endif
 
-    k_work_cancel_delayable(&data->work);
+    data->tuning = tuning;
 
-#if USE_INTERRUPTS
-    return kscan_matrix_interrupt_disable(dev);
+    const uint32_t press_ticks =
+        kscan_matrix_debounce_ticks(tuning.debounce_press_ms, tuning.scan_period_us);
+    const uint32_t release_ticks =
+        kscan_matrix_debounce_ticks(tuning.debounce_release_ms, tuning.scan_period_us);
+
+#if USE_PACKED_DEBOUNCE
+    data->core_config.debounce_config.press_ticks = press_ticks;
+    data->core_config.debounce_config.release_ticks = release_ticks;
+    // The overrides were checked against the new period by kscan_matrix_tune().
+    kscan_matrix_init_debounce(dev);
 #else
-    return 0;
+    data->core_config.debounce_config.debounce_press_ms = press_ticks;
+    data->core_config.debounce_config.debounce_release_ms = release_ticks;
 #endif
+
+    my_kscan_core_restart_debounce(&data->core, &data->core_config);
+
+    LOG_INF("%s: scan %u us, poll %u us, debounce %u/%u ms", dev->name, tuning.scan_period_us,
+            tuning.poll_period_us, tuning.debounce_press_ms, tuning.debounce_release_ms);
 }
+#endif // USE_TUNING
 
-static int kscan_matrix_init_input_inst(const struct device *dev, const struct kscan_gpio *gpio) {
-    if (!device_is_ready(gpio->spec.port)) {
-        LOG_ERR("GPIO is not ready: %s", gpio->spec.port->name);
-        return -ENODEV;
-    }
+static int my_kscan_matrix_init(const struct device *dev) {
+    LOG_INF("Initializing kscan matrix %s", dev->name);
+    struct kscan_matrix_data *data = dev->data;
 
-    int err = gpio_pin_configure_dt(&gpio->spec, GPIO_INPUT);
-    if (err) {
-        LOG_ERR("Unable to configure pin %u on %s for input", gpio->spec.pin,
-                gpio->spec.port->name);
-        return err;
-    }
+    data->dev = dev;
 
-    err = gpio_pin_set_dt(&gpio->spec, 0);
+    int err = 0;
+
+#if USE_TUNING
+    kscan_matrix_init_tuning(dev);
+#endif
+
+#if USE_PACKED_DEBOUNCE
+    err = kscan_matrix_init_debounce(dev);
     if (err) {
-        LOG_ERR("Unable to set pin %u on %s to low", gpio->spec.pin, gpio->spec.port->name);
         return err;
     }
+#endif
 
-    // LOG_DBG("Configured pin %u on %s for input", gpio->spec.pin, gpio->spec.port->name);
+#if USE_STATS
+    data->stats.since_ms = k_uptime_get();
+#if IS_ENABLED(CONFIG_STATS)
+    stats_init_and_reg(&data->stats.group.s_hdr,
+                       STATS_SIZE_INIT_PARMS(data->stats.group, STATS_SIZE_32),
+                       STATS_NAME_INIT_PARMS(my_kscan), dev->name);
+#endif
+#endif
+
+#if USE_SCAN_THREAD
+    const struct kscan_matrix_config *config = dev->config;
+
+    k_sem_init(&data->scan_sem, 0, 1);
+    k_timer_init(&data->scan_timer, kscan_matrix_scan_timer_handler, NULL);
+    k_thread_create(&data->thread, config->stack, config->stack_size, kscan_matrix_thread,
+                    (void *)dev, NULL, NULL, CONFIG_ZMK_MY_KSCAN_SCAN_THREAD_PRIORITY, 0,
+                    K_NO_WAIT);
+    k_thread_name_set(&data->thread, dev->name);
+#elif USE_COORDINATOR
+    k_spinlock_key_t key = k_spin_lock(&kscan_matrix_coordinator_lock);
+    kscan_matrix_coordinated[kscan_matrix_coordinated_len++] = dev;
+    k_spin_unlock(&kscan_matrix_coordinator_lock, key);
+#else
+    k_work_init_delayable(&data->work, kscan_matrix_work_handler);
+#endif
 
 #if USE_INTERRUPTS
-    struct kscan_matrix_data *data = dev->data;
-    struct kscan_matrix_irq_callback *irq = &data->irqs[gpio->index];
+    k_timer_init(&data->arm_timer, kscan_matrix_arm_timer_handler, NULL);
+#if !USE_BATCHED_DRIVE
+    k_work_init(&data->arm_work, kscan_matrix_arm_work_handler);
+#endif
+#endif
+
+#if USE_SHIFT_REGISTER_ASYNC
+    k_poll_signal_init(&data->shift_signal);
+#endif
 
-    irq->dev = dev;
-    gpio_init_callback(&irq->callback, kscan_matrix_irq_callback_handler, BIT(gpio->spec.pin));
-    err = gpio_add_callback(gpio->spec.port, &irq->callback);
+    err = kscan_matrix_init_callbacks(dev);
     if (err) {
-        LOG_ERR("Error adding the callback to the input device: %i", err);
         return err;
     }
+
+#if IS_ENABLED(CONFIG_PM_DEVICE)
+    pm_device_init_suspended(dev);
+
+#if IS_ENABLED(CONFIG_PM_DEVICE_RUNTIME)
+    pm_device_runtime_enable(dev);
 #endif
 
     return 0;
+#else
+    return kscan_matrix_setup_pins(dev);
+#endif
 }
 
-static int kscan_matrix_init_pins(const struct device *dev) {
-    const struct kscan_matrix_data *data = dev->data;
+#if IS_ENABLED(CONFIG_PM_DEVICE)
 
-    for (int i = 0; i < data->inputs.len; i++) {
-        const struct kscan_gpio *gpio = &data->inputs.gpios[i];
-        int err = kscan_matrix_init_input_inst(dev, gpio);
+static int kscan_matrix_pm_action(const struct device *dev, enum pm_device_action action) {
+    switch (action) {
+    case PM_DEVICE_ACTION_SUSPEND:
+        kscan_matrix_disconnect(dev);
+
+        return kscan_matrix_disable(dev);
+    case PM_DEVICE_ACTION_RESUME: {
+#if USE_ENERGY
+        struct kscan_matrix_data *data = dev->data;
+
+        data->stats.resumes++;
+#endif
+        const int err = kscan_matrix_setup_pins(dev);
         if (err) {
             return err;
         }
+
+        return kscan_matrix_enable(dev);
+    }
+    default:
+        return -ENOTSUP;
     }
+}
 
-    for (int i = 0; i < data->outputs.len; i++) {
-        const struct kscan_gpio *gpio = &data->outputs.gpios[i];
-        int err = kscan_matrix_init_input_inst(dev, gpio);
-        if (err) {
-            return err;
+#endif // IS_ENABLED(CONFIG_PM_DEVICE)
+
+static const struct kscan_driver_api kscan_matrix_api = {
+    .config = kscan_matrix_configure,
+    .enable_callback = kscan_matrix_enable,
+    .disable_callback = kscan_matrix_disable,
+};
+
+/*
+ * Everything an instance defines besides its own lines, key map and phases,
+ * which the caller has already declared as kscan_matrix_phases_##id. The
+ * data_fields and config_fields initializers carry the wiring.
+ */
+#define KSCAN_MATRIX_DEFINE(n, id, matrix_keys, keys_per_row, lines_len, sense_len, data_fields,   \
+                            config_fields)                                                         \
+    BUILD_ASSERT(INST_DEBOUNCE_PRESS_TICKS(n) <= DEBOUNCE_COUNTER_MAX,                             \
+                 "ZMK_KSCAN_DEBOUNCE_PRESS_MS or debounce-press-ms is too large");                 \
+    BUILD_ASSERT(INST_DEBOUNCE_RELEASE_TICKS(n) <= DEBOUNCE_COUNTER_MAX,                           \
+                 "ZMK_KSCAN_DEBOUNCE_RELEASE_MS or debounce-release-ms is too large");             \
+    BUILD_ASSERT(!USE_PACKED_DEBOUNCE ||                                                           \
+                     MAX(INST_DEBOUNCE_PRESS_TICKS(n), INST_DEBOUNCE_RELEASE_TICKS(n)) <=          \
+                         MY_KSCAN_DEBOUNCE_TICKS_MAX,                                              \
+                 "Debounce time in scans exceeds ZMK_MY_KSCAN_DEBOUNCE_PACKED_BITS");              \
+    BUILD_ASSERT(INST_KEYS_LEN(n, matrix_keys) <= UINT16_MAX, "Too many keys in the matrix");      \
+    BUILD_ASSERT(USE_PACKED_DEBOUNCE || !DT_INST_NODE_HAS_PROP(n, debounce_overrides),             \
+                 "debounce-overrides needs ZMK_MY_KSCAN_DEBOUNCE_PACKED");                         \
+    BUILD_ASSERT(DT_INST_PROP_LEN_OR(n, debounce_overrides, 0) % 4 == 0,                           \
+                 "debounce-overrides takes groups of row, column, press ms, release ms");          \
+                                                                                                   \
+    IF_ENABLED(DT_INST_NODE_HAS_PROP(n, direct_gpios),                                             \
+               (static const struct kscan_gpio kscan_matrix_direct_##id[] = {                      \
+                    LISTIFY(INST_DIRECT_LEN(n), KSCAN_GPIO_DIRECT_CFG_INIT, (, ), n)};             \
+                static const struct kscan_matrix_port kscan_matrix_direct_ports_##id[] = {         \
+                    DT_INST_FOREACH_PROP_ELEM_SEP(n, direct_gpios, PLAN_PORT, (, ))};              \
+                static const struct kscan_matrix_sense kscan_matrix_direct_sense_##id[] = {        \
+                    DT_INST_FOREACH_PROP_ELEM_SEP(n, direct_gpios, PLAN_SENSE, (, ))};             \
+                static const struct kscan_matrix_lines kscan_matrix_direct_lines_##id = {          \
+                    .gpios = kscan_matrix_direct_##id,                                             \
+                    .ports = kscan_matrix_direct_ports_##id,                                       \
+                    .sense = kscan_matrix_direct_sense_##id,                                       \
+                    .len = INST_DIRECT_LEN(n),                                                     \
+                };))                                                                               \
+                                                                                                   \
+    static const uint32_t kscan_matrix_scan_periods_##id[] = {                                     \
+        INST_SCAN_PERIOD_US(n) IF_ENABLED(DT_INST_NODE_HAS_PROP(n, scan_backoff_us),               \
+                                          (DT_INST_FOREACH_PROP_ELEM(n, scan_backoff_us,           \
+                                                                     INST_SCAN_BACKOFF)))};        \
+    BUILD_ASSERT(ARRAY_SIZE(kscan_matrix_scan_periods_##id) < UINT8_MAX,                           \
+                 "Too many scan-backoff-us steps");                                                \
+                                                                                                   \
+    static gpio_port_value_t kscan_matrix_port_values_##id[MAX(sense_len, INST_DIRECT_LEN(n))];    \
+                                                                                                   \
+    BUILD_ASSERT(INST_KEY_WORDS(n, matrix_keys) <= 32,                                             \
+                 "Too many keys for the changed-word summary");                                    \
+    static uint32_t kscan_matrix_changed_##id[INST_KEY_WORDS(n, matrix_keys)];                     \
+    static uint32_t kscan_matrix_pressed_##id[INST_KEY_WORDS(n, matrix_keys)];                     \
+    IF_ENABLED(USE_QUARANTINE,                                                                     \
+               (static uint32_t kscan_matrix_quarantine_##id[INST_KEY_WORDS(n, matrix_keys)];))    \
+                                                                                                   \
+    COND_CODE_1(                                                                                   \
+        USE_PACKED_DEBOUNCE,                                                                       \
+        (static uint32_t kscan_matrix_raw_##id[INST_KEY_WORDS(n, matrix_keys)];                    \
+         static struct my_kscan_debounce_word kscan_matrix_state_##id[INST_KEY_WORDS(              \
+             n, matrix_keys)];                                                                     \
+         IF_ENABLED(DT_INST_NODE_HAS_PROP(n, debounce_overrides),                                  \
+                    (static const uint32_t kscan_matrix_debounce_overrides_##id[] =                \
+                         DT_INST_PROP(n, debounce_overrides);                                      \
+                     static struct my_kscan_debounce_planes kscan_matrix_debounce_planes_##id      \
+                         [INST_KEY_WORDS(n, matrix_keys)];))),                                     \
+        (static struct zmk_debounce_state                                                          \
+             kscan_matrix_state_##id[INST_KEYS_LEN(n, matrix_keys)];))                             \
+                                                                                                   \
+    COND_INTERRUPTS((static struct kscan_matrix_irq_callback                                       \
+                         kscan_matrix_irqs_##id[(lines_len) + INST_DIRECT_LEN(n)];))               \
+                                                                                                   \
+    IF_ENABLED(USE_SETTLE_CALIBRATION,                                                             \
+               (static struct kscan_matrix_settle                                                  \
+                    kscan_matrix_settle_##id[ARRAY_SIZE(kscan_matrix_phases_##id)];))              \
+                                                                                                   \
+    IF_ENABLED(USE_TRACE, (static uint32_t kscan_matrix_trace_##id                                 \
+                               [CONFIG_ZMK_MY_KSCAN_TRACE_FRAMES *                                 \
+                                MY_KSCAN_TRACE_FRAME_WORDS(INST_KEY_WORDS(n, matrix_keys))];))     \
+                                                                                                   \
+    IF_ENABLED(USE_PARTIAL_SCAN,                                                                   \
+               (static uint32_t kscan_matrix_hot_phases_##id                                       \
+                    [DIV_ROUND_UP(ARRAY_SIZE(kscan_matrix_phases_##id), 32)];))                    \
+                                                                                                   \
+    IF_ENABLED(USE_SNAPSHOT, (static uint32_t kscan_matrix_snapshot_raw_##id                       \
+                                  [2][INST_KEY_WORDS(n, matrix_keys)];))                           \
+                                                                                                   \
+    IF_ENABLED(USE_SCAN_THREAD, (static K_THREAD_STACK_DEFINE(                                     \
+                                    kscan_matrix_stack_##id,                                       \
+                                    CONFIG_ZMK_MY_KSCAN_SCAN_THREAD_STACK_SIZE);))                 \
+                                                                                                   \
+    static struct kscan_matrix_data kscan_matrix_data_##id = {                                     \
+        __DEBRACKET data_fields                                                                    \
+        .port_values = kscan_matrix_port_values_##id,                                              \
+        .core =                                                                                    \
+            {                                                                                      \
+                .matrix_state = kscan_matrix_state_##id,                                           \
+                .changed_keys = kscan_matrix_changed_##id,                                         \
+                .pressed_keys = kscan_matrix_pressed_##id,                                         \
+                IF_ENABLED(USE_PACKED_DEBOUNCE, (.raw_state = kscan_matrix_raw_##id, ))            \
+                IF_ENABLED(USE_QUARANTINE, (.quarantine = kscan_matrix_quarantine_##id, ))         \
+            },                                                                                     \
+        IF_ENABLED(USE_TRACE, (.trace = {.buffer = kscan_matrix_trace_##id,                        \
+                                         .frames = CONFIG_ZMK_MY_KSCAN_TRACE_FRAMES,               \
+                                         .key_words = INST_KEY_WORDS(n, matrix_keys)}, ))          \
+        IF_ENABLED(USE_SNAPSHOT, (.snapshot_raw = kscan_matrix_snapshot_raw_##id[0],               \
+                                  .scan_raw = kscan_matrix_snapshot_raw_##id[1], ))                \
+        IF_ENABLED(USE_PARTIAL_SCAN, (.hot_phases = kscan_matrix_hot_phases_##id, ))               \
+        IF_ENABLED(USE_SETTLE_CALIBRATION, (.settle = kscan_matrix_settle_##id, ))                 \
+        COND_INTERRUPTS((.irqs = kscan_matrix_irqs_##id, ))};                                      \
+                                                                                                   \
+    static const struct kscan_matrix_config kscan_matrix_config_##id = {                           \
+        __DEBRACKET config_fields                                                                  \
+        .phases = kscan_matrix_phases_##id,                                                        \
+        .phases_len = ARRAY_SIZE(kscan_matrix_phases_##id),                                        \
+        .direct_lines = COND_CODE_1(DT_INST_NODE_HAS_PROP(n, direct_gpios),                        \
+                                    (&kscan_matrix_direct_lines_##id), (NULL)),                    \
+        .direct_key = matrix_keys,                                                                 \
+        .core =                                                                                    \
+            {                                                                                      \
+                .debounce_config = COND_CODE_1(                                                    \
+                    USE_PACKED_DEBOUNCE,                                                           \
+                    ({                                                                             \
+                        .press_ticks = INST_DEBOUNCE_PRESS_TICKS(n),                               \
+                        .release_ticks = INST_DEBOUNCE_RELEASE_TICKS(n),                           \
+                        .strategy = KSCAN_DEBOUNCE_STRATEGY,                                       \
+                    }),                                                                            \
+                    ({                                                                             \
+                        .debounce_press_ms = INST_DEBOUNCE_PRESS_TICKS(n),                         \
+                        .debounce_release_ms = INST_DEBOUNCE_RELEASE_TICKS(n),                     \
+                    })),                                                                           \
+                .keys = INST_KEYS_LEN(n, matrix_keys),                                             \
+                .key_words = INST_KEY_WORDS(n, matrix_keys),                                       \
+                .row_keys = keys_per_row,                                                          \
+                IF_ENABLED(USE_PACKED_DEBOUNCE,                                                    \
+                           (IF_ENABLED(DT_INST_NODE_HAS_PROP(n, debounce_overrides),               \
+                                       (.debounce_planes = kscan_matrix_debounce_planes_##id, )))) \
+            },                                                                                     \
+        IF_ENABLED(USE_PACKED_DEBOUNCE,                                                            \
+                   (IF_ENABLED(DT_INST_NODE_HAS_PROP(n, debounce_overrides),                       \
+                               (.debounce_overrides = kscan_matrix_debounce_overrides_##id,        \
+                                .debounce_overrides_len =                                          \
+                                    ARRAY_SIZE(kscan_matrix_debounce_overrides_##id), ))))         \
+        .scan_periods_us = kscan_matrix_scan_periods_##id,                                         \
+        .scan_periods_len = ARRAY_SIZE(kscan_matrix_scan_periods_##id),                            \
+        .backoff_scans = DT_INST_PROP(n, scan_backoff_scans),                                      \
+        .poll_period_us = DT_INST_PROP(n, poll_period_ms) * USEC_PER_MSEC,                         \
+        IF_ENABLED(USE_TUNING,                                                                     \
+                   (.tuning = {.scan_period_us = INST_SCAN_PERIOD_US(n),                           \
+                               .poll_period_us = DT_INST_PROP(n, poll_period_ms) * USEC_PER_MSEC,  \
+                               .debounce_press_ms = INST_DEBOUNCE_PRESS_MS(n),                     \
+                               .debounce_release_ms = INST_DEBOUNCE_RELEASE_MS(n)}, ))             \
+        IF_ENABLED(USE_SCAN_THREAD,                                                                \
+                   (.stack = kscan_matrix_stack_##id,                                              \
+                    .stack_size = K_THREAD_STACK_SIZEOF(kscan_matrix_stack_##id), ))               \
+    };                                                                                             \
+                                                                                                   \
+    PM_DEVICE_DT_INST_DEFINE(n, kscan_matrix_pm_action);                                           \
+                                                                                                   \
+    DEVICE_DT_INST_DEFINE(n, &my_kscan_matrix_init, PM_DEVICE_DT_INST_GET(n),                      \
+                          &kscan_matrix_data_##id, &kscan_matrix_config_##id, POST_KERNEL,         \
+                          CONFIG_KSCAN_INIT_PRIORITY, &kscan_matrix_api);
+
+#define MY_KSCAN_MATRIX_INIT(n)                                                                    \
+    static const struct kscan_gpio kscan_matrix_rows_##n[] = {                                     \
+        LISTIFY(INST_ROWS_LEN(n), KSCAN_GPIO_ROW_CFG_INIT, (, ), n)};                              \
+                                                                                                   \
+    static const struct kscan_gpio kscan_matrix_cols_##n[] = {                                     \
+        LISTIFY(INST_COLS_LEN(n), KSCAN_GPIO_COL_CFG_INIT, (, ), n)};                              \
+                                                                                                   \
+    static const struct kscan_matrix_port kscan_matrix_row_ports_##n[] = {                         \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, row_gpios, PLAN_PORT, (, ))};                             \
+    static const struct kscan_matrix_sense kscan_matrix_row_sense_##n[] = {                        \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, row_gpios, PLAN_SENSE, (, ))};                            \
+    static const struct kscan_matrix_lines kscan_matrix_row_lines_##n = {                          \
+        .gpios = kscan_matrix_rows_##n,                                                            \
+        .ports = kscan_matrix_row_ports_##n,                                                       \
+        .sense = kscan_matrix_row_sense_##n,                                                       \
+        .len = INST_ROWS_LEN(n),                                                                   \
+    };                                                                                             \
+                                                                                                   \
+    static const struct kscan_matrix_port kscan_matrix_col_ports_##n[] = {                         \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, col_gpios, PLAN_PORT, (, ))};                             \
+    static const struct kscan_matrix_sense kscan_matrix_col_sense_##n[] = {                        \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, col_gpios, PLAN_SENSE, (, ))};                            \
+    static const struct kscan_matrix_lines kscan_matrix_col_lines_##n = {                          \
+        .gpios = kscan_matrix_cols_##n,                                                            \
+        .ports = kscan_matrix_col_ports_##n,                                                       \
+        .sense = kscan_matrix_col_sense_##n,                                                       \
+        .len = INST_COLS_LEN(n),                                                                   \
+    };                                                                                             \
+                                                                                                   \
+    static const uint16_t kscan_matrix_keys_##n[] = {                                              \
+        DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, row_gpios, PLAN_ROW2COL_KEYS, (, ), n),             \
+        DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, col_gpios, PLAN_COL2ROW_KEYS, (, ), n)};            \
+                                                                                                   \
+    static const struct kscan_matrix_phase kscan_matrix_phases_##n[] = {                           \
+        DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, row_gpios, PLAN_ROW2COL_PHASE, (, ), n),            \
+        DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, col_gpios, PLAN_COL2ROW_PHASE, (, ), n)};           \
+                                                                                                   \
+    KSCAN_MATRIX_DEFINE(                                                                           \
+        n, n, INST_MATRIX_LEN(n), 2 * INST_COLS_LEN(n), INST_LINES_LEN(n),                         \
+        MAX(INST_ROWS_LEN(n), INST_COLS_LEN(n)),                                                   \
+        (.inputs = KSCAN_GPIO_LIST(kscan_matrix_rows_##n),                                         \
+         .outputs = KSCAN_GPIO_LIST(kscan_matrix_cols_##n), ),                                     \
+        (.rows = ARRAY_SIZE(kscan_matrix_rows_##n), .cols = ARRAY_SIZE(kscan_matrix_cols_##n),     \
+         .row_lines = &kscan_matrix_row_lines_##n, .col_lines = &kscan_matrix_col_lines_##n,       \
+         .wake_toggle_period_ms = DT_INST_PROP(n, wake_toggle_period_ms),                          \
+         .diode_direction = INST_DIODE_DIR(n), ))
+
+DT_INST_FOREACH_STATUS_OKAY(MY_KSCAN_MATRIX_INIT);
+
+#undef DT_DRV_COMPAT
+#define DT_DRV_COMPAT zmk_my_kscan_charlieplex
+
+#define MY_KSCAN_CHARLIEPLEX_INIT(n)                                                               \
+    static const struct kscan_gpio kscan_matrix_pins_charlieplex_##n[] = {                         \
+        LISTIFY(INST_PINS_LEN(n), KSCAN_GPIO_PIN_CFG_INIT, (, ), n)};                              \
+                                                                                                   \
+    static const struct kscan_matrix_port kscan_matrix_pin_ports_charlieplex_##n[] = {             \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, gpios, PLAN_PORT, (, ))};                                 \
+    static const struct kscan_matrix_sense kscan_matrix_pin_sense_charlieplex_##n[] = {            \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, gpios, PLAN_SENSE, (, ))};                                \
+    static const struct kscan_matrix_lines kscan_matrix_pin_lines_charlieplex_##n = {              \
+        .gpios = kscan_matrix_pins_charlieplex_##n,                                                \
+        .ports = kscan_matrix_pin_ports_charlieplex_##n,                                           \
+        .sense = kscan_matrix_pin_sense_charlieplex_##n,                                           \
+        .len = INST_PINS_LEN(n),                                                                   \
+    };                                                                                             \
+                                                                                                   \
+    static const uint16_t kscan_matrix_keys_charlieplex_##n[] = {                                  \
+        DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, gpios, PLAN_CHARLIEPLEX_KEYS, (, ), n)};            \
+                                                                                                   \
+    static const struct kscan_matrix_phase kscan_matrix_phases_charlieplex_##n[] = {               \
+        DT_INST_FOREACH_PROP_ELEM_SEP_VARGS(n, gpios, PLAN_CHARLIEPLEX_PHASE, (, ), n)};           \
+                                                                                                   \
+    KSCAN_MATRIX_DEFINE(n, charlieplex_##n, INST_PINS_LEN(n) * INST_PINS_LEN(n),                   \
+                        INST_PINS_LEN(n), INST_PINS_LEN(n), INST_PINS_LEN(n),                      \
+                        (.inputs = KSCAN_GPIO_LIST(kscan_matrix_pins_charlieplex_##n), ),          \
+                        (.rows = INST_PINS_LEN(n),                                                 \
+                         .row_lines = &kscan_matrix_pin_lines_charlieplex_##n, ))
+
+DT_INST_FOREACH_STATUS_OKAY(MY_KSCAN_CHARLIEPLEX_INIT);
+
+#if USE_SHIFT_REGISTER
+
+#undef DT_DRV_COMPAT
+#define DT_DRV_COMPAT zmk_my_kscan_shift_register
+
+#define MY_KSCAN_SHIFT_REGISTER_INIT(n)                                                            \
+    static const struct kscan_gpio kscan_matrix_sense_shift_##n[] = {                              \
+        LISTIFY(INST_SENSE_LEN(n), KSCAN_GPIO_SENSE_CFG_INIT, (, ), n)};                           \
+                                                                                                   \
+    static const struct kscan_matrix_port kscan_matrix_sense_ports_shift_##n[] = {                 \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, sense_gpios, PLAN_PORT, (, ))};                           \
+    static const struct kscan_matrix_sense kscan_matrix_sense_sense_shift_##n[] = {                \
+        DT_INST_FOREACH_PROP_ELEM_SEP(n, sense_gpios, PLAN_SENSE, (, ))};                          \
+    static const struct kscan_matrix_lines kscan_matrix_sense_lines_shift_##n = {                  \
+        .gpios = kscan_matrix_sense_shift_##n,                                                     \
+        .ports = kscan_matrix_sense_ports_shift_##n,                                               \
+        .sense = kscan_matrix_sense_sense_shift_##n,                                               \
+        .len = INST_SENSE_LEN(n),                                                                  \
+    };                                                                                             \
+                                                                                                   \
+    static const uint16_t kscan_matrix_keys_shift_##n[] = {                                        \
+        LISTIFY(INST_SHIFT_LINES(n), PLAN_SHIFT_KEYS, (, ), n)};                                   \
+                                                                                                   \
+    static const struct kscan_matrix_phase kscan_matrix_phases_shift_##n[] = {                     \
+        LISTIFY(INST_SHIFT_LINES(n), PLAN_SHIFT_PHASE, (, ), n)};                                  \
+                                                                                                   \
+    static const struct kscan_matrix_shift_register kscan_matrix_shift_register_##n = {            \
+        .spi = SPI_DT_SPEC_INST_GET(n, SPI_OP_MODE_MASTER | SPI_TRANSFER_MSB | SPI_WORD_SET(8),    \
+                                    0),                                                            \
+        .bytes = DIV_ROUND_UP(INST_SHIFT_LINES(n), 8),                                             \
+    };                                                                                             \
+    static uint8_t kscan_matrix_shift_pattern_##n[DIV_ROUND_UP(INST_SHIFT_LINES(n), 8)];           \
+                                                                                                   \
+    KSCAN_MATRIX_DEFINE(n, shift_##n, INST_SHIFT_LINES(n) * INST_SENSE_LEN(n), INST_SENSE_LEN(n),  \
+                        INST_SENSE_LEN(n), INST_SENSE_LEN(n),                                      \
+                        (.inputs = KSCAN_GPIO_LIST(kscan_matrix_sense_shift_##n),                  \
+                         .shift_pattern = kscan_matrix_shift_pattern_##n,                          \
+                         .shift_line = KSCAN_MATRIX_SHIFT_NONE, ),                                 \
+                        (.rows = INST_SHIFT_LINES(n),                                              \
+                         .row_lines = &kscan_matrix_sense_lines_shift_##n,                         \
+                         .shift_register = &kscan_matrix_shift_register_##n, ))
+
+DT_INST_FOREACH_STATUS_OKAY(MY_KSCAN_SHIFT_REGISTER_INIT);
+
+#endif // USE_SHIFT_REGISTER
+
+#if USE_TUNING || (IS_ENABLED(CONFIG_SHELL) && (USE_STATS || USE_TRACE))
+
+#define KSCAN_MATRIX_DEVICE_GET(node_id) DEVICE_DT_GET(node_id),
+
+static const struct device *const kscan_matrix_devices[] = {
+    DT_FOREACH_STATUS_OKAY(zmk_my_kscan, KSCAN_MATRIX_DEVICE_GET)
+        DT_FOREACH_STATUS_OKAY(zmk_my_kscan_charlieplex, KSCAN_MATRIX_DEVICE_GET)
+            DT_FOREACH_STATUS_OKAY(zmk_my_kscan_shift_register, KSCAN_MATRIX_DEVICE_GET)};
+
+#endif
+
+#if USE_TUNING
+#define KSCAN_MATRIX_SETTINGS_ROOT "my_kscan"
+
+static const struct device *kscan_matrix_find_device(const char *name) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        if (strcmp(kscan_matrix_devices[i]->name, name) == 0) {
+            return kscan_matrix_devices[i];
         }
     }
 
-    return 0;
+    return NULL;
 }
 
-#if IS_ENABLED(CONFIG_PM_DEVICE)
+#if IS_ENABLED(CONFIG_SETTINGS)
+/** Load the parameters saved as my_kscan/<device name>. */
+static int kscan_matrix_settings_set(const char *name, size_t len, settings_read_cb read_cb,
+                                     void *cb_arg) {
+    const struct device *dev = kscan_matrix_find_device(name);
+    struct kscan_matrix_tuning tuning;
 
-static int kscan_matrix_disconnect(const struct device *dev) {
-    const struct kscan_matrix_data *data = dev->data;
+    if (!dev) {
+        return -ENOENT;
+    }
 
-    for (int i = 0; i < data->inputs.len; i++) {
-        const struct gpio_dt_spec *gpio = &data->inputs.gpios[i].spec;
-        int err = gpio_pin_configure_dt(gpio, GPIO_DISCONNECTED);
-        if (err) {
-            return err;
-        }
+    if (len != sizeof(tuning)) {
+        return -EINVAL;
     }
 
-    for (int i = 0; i < data->outputs.len; i++) {
-    const struct gpio_dt_spec *gpio = &data->outputs.gpios[i].spec;
-    int err = gpio_pin_configure_dt(gpio, GPIO_DISCONNECTED);
+    const int rc = read_cb(cb_arg, &tuning, sizeof(tuning));
+    if (rc < 0) {
+        return rc;
+    }
+
+    const int err = kscan_matrix_tune(dev, &tuning);
     if (err) {
-        return err;
+        LOG_WRN("Ignoring saved scan parameters of %s: %i", dev->name, err);
     }
+
+    return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(my_kscan, KSCAN_MATRIX_SETTINGS_ROOT, NULL,
+                               kscan_matrix_settings_set, NULL, NULL);
+#endif // IS_ENABLED(CONFIG_SETTINGS)
+#endif // USE_TUNING
+
+#if IS_ENABLED(CONFIG_SHELL) && (USE_STATS || USE_TRACE || USE_TUNING)
+
+#if USE_STATS
+
+static void kscan_matrix_print_histogram(const struct shell *sh, const char *name,
+                                         const struct my_kscan_histogram *hist) {
+    shell_print(sh, "  %-8s n=%u avg=%u p50<=%u p99<=%u max=%u us", name, hist->count,
+                hist->count ? (uint32_t)(hist->sum / hist->count) : 0,
+                my_kscan_histogram_percentile(hist, 50), my_kscan_histogram_percentile(hist, 99),
+                hist->max);
 }
 
+static int cmd_my_kscan_stats(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        const struct device *dev = kscan_matrix_devices[i];
+        const struct kscan_matrix_data *data = dev->data;
+        const struct kscan_matrix_stats *stats = &data->stats;
+        const int64_t elapsed = k_uptime_get() - stats->since_ms;
+        const uint32_t rate =
+            elapsed > 0 ? (uint32_t)((uint64_t)stats->scans * MSEC_PER_SEC / elapsed) : 0;
+
+        shell_print(sh, "%s: %u scans (%u/s), %u events, %u overruns, lateness max %u us",
+                    dev->name, stats->scans, rate, stats->events, data->overruns,
+                    data->max_lateness_us);
+        kscan_matrix_print_histogram(sh, "scan", &stats->scan);
+        kscan_matrix_print_histogram(sh, "row2col", &stats->half[KSCAN_ROW2COL]);
+        kscan_matrix_print_histogram(sh, "col2row", &stats->half[KSCAN_COL2ROW]);
+        kscan_matrix_print_histogram(sh, "irq", &stats->irq);
+        kscan_matrix_print_histogram(sh, "press", &stats->press);
+        kscan_matrix_print_histogram(sh, "late", &stats->lateness);
+    }
+
     return 0;
 }
 
+static int cmd_my_kscan_stats_reset(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        kscan_matrix_stats_clear(kscan_matrix_devices[i]->data);
+    }
 
-#endif // IS_ENABLED(CONFIG_PM_DEVICE)
+    shell_print(sh, "Statistics cleared");
+    return 0;
+}
 
-static void kscan_matrix_setup_pins(const struct device *dev) { kscan_matrix_init_pins(dev); }
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_my_kscan_stats,
+                               SHELL_CMD(reset, NULL, "Clear the counters and histograms",
+                                         cmd_my_kscan_stats_reset),
+                               SHELL_SUBCMD_SET_END);
+
+#if USE_ENERGY
+#define KSCAN_MATRIX_MSEC_PER_HOUR ((uint64_t)MSEC_PER_SEC * SEC_PER_MIN * MIN_PER_HOUR)
+
+/**
+ * Print one counter as a total, per key press and per hour since the counters
+ * were cleared. Durations are counted in microseconds and shown in
+ * milliseconds, except per press.
+ */
+static void kscan_matrix_print_energy(const struct shell *sh, const char *name,
+                                      const uint64_t total, const bool duration,
+                                      const uint32_t presses, const int64_t elapsed_ms) {
+    const uint32_t scale = duration ? USEC_PER_MSEC : 1;
+    const uint64_t per_hour =
+        elapsed_ms > 0 ? total * KSCAN_MATRIX_MSEC_PER_HOUR / elapsed_ms / scale : 0;
+
+    shell_print(sh, "  %-7s total=%u%s per-press=%u%s per-hour=%u%s", name,
+                (uint32_t)(total / scale), duration ? " ms" : "",
+                presses ? (uint32_t)(total / presses) : 0, duration ? " us" : "",
+                (uint32_t)per_hour, duration ? " ms" : "");
+}
 
-static int my_kscan_matrix_init(const struct device *dev) {
-    LOG_INF("Initializing kscan matrix %s", dev->name);
-    struct kscan_matrix_data *data = dev->data;
+static int cmd_my_kscan_energy(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        const struct device *dev = kscan_matrix_devices[i];
+        const struct kscan_matrix_data *data = dev->data;
+        const struct kscan_matrix_stats *stats = &data->stats;
+        const int64_t elapsed = k_uptime_get() - stats->since_ms;
+        const uint32_t presses = stats->presses;
+
+        shell_print(sh, "%s: %u presses and %u resumes in %u s", dev->name, presses,
+                    stats->resumes, (uint32_t)(elapsed / MSEC_PER_SEC));
+        kscan_matrix_print_energy(sh, "scans", stats->scans, false, presses, elapsed);
+        kscan_matrix_print_energy(sh, "irq", stats->irq.count, false, presses, elapsed);
+        kscan_matrix_print_energy(sh, "poll", stats->poll_wakes, false, presses, elapsed);
+        kscan_matrix_print_energy(sh, "toggle", stats->arm_toggles, false, presses, elapsed);
+        kscan_matrix_print_energy(sh, "settle", stats->settle_us, true, presses, elapsed);
+        kscan_matrix_print_energy(sh, "drive", stats->drive_us, true, presses, elapsed);
+        kscan_matrix_print_energy(sh, "tail", stats->tail_us, true, presses, elapsed);
+    }
 
-    data->dev = dev;
+    return 0;
+}
 
-    // Sort inputs by port so we can read each port just once per scan.
-    my_kscan_gpio_list_sort_by_port(&data->inputs);
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_my_kscan_energy,
+                               SHELL_CMD(reset, NULL, "Clear the counters and histograms",
+                                         cmd_my_kscan_stats_reset),
+                               SHELL_SUBCMD_SET_END);
+#endif // USE_ENERGY
 
-    k_work_init_delayable(&data->work, kscan_matrix_work_handler);
+#endif // USE_STATS
 
-#if IS_ENABLED(CONFIG_PM_DEVICE)
-    pm_device_init_suspended(dev);
+#if USE_TRACE
+static int cmd_my_kscan_trace(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        const struct device *dev = kscan_matrix_devices[i];
+        struct kscan_matrix_data *data = dev->data;
+        struct my_kscan_trace *trace = &data->trace;
+        const uint32_t *frame;
 
-#if IS_ENABLED(CONFIG_PM_DEVICE_RUNTIME)
-    pm_device_runtime_enable(dev);
+        shell_print(sh, "%s: %u frames dropped", dev->name, trace->dropped);
+
+        while ((frame = my_kscan_trace_peek(trace)) != NULL) {
+            char keys[MY_KSCAN_DEBOUNCE_WORD_BITS * 9 + 1];
+            const uint32_t *words = &frame[MY_KSCAN_TRACE_HEADER_WORDS];
+            int len = 0;
+
+            for (int w = 0; w < trace->key_words; w++) {
+                len += snprintf(&keys[len], sizeof(keys) - len, " %08x", words[w]);
+            }
+
+            shell_print(sh, "%u %u%s", frame[MY_KSCAN_TRACE_SEQ], frame[MY_KSCAN_TRACE_TIME_US],
+                        keys);
+            my_kscan_trace_release(trace);
+        }
+    }
+
+    return 0;
+}
+
+#if USE_PACKED_DEBOUNCE
+static const char *const kscan_matrix_debounce_names[MY_KSCAN_DEBOUNCE_STRATEGIES] = {
+    [MY_KSCAN_DEBOUNCE_INTEGRATOR] = "integrator",
+    [MY_KSCAN_DEBOUNCE_DEFER] = "defer",
+    [MY_KSCAN_DEBOUNCE_EAGER] = "eager",
+    [MY_KSCAN_DEBOUNCE_EAGER_DEFER] = "eager-defer",
+};
+
+/**
+ * Replay the captured frames through every strategy with the thresholds of
+ * the matrix. Lag is the time each key's debounced state spent disagreeing
+ * with its raw samples, summed over keys and divided by the events reported.
+ */
+static int cmd_my_kscan_trace_compare(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        const struct device *dev = kscan_matrix_devices[i];
+        const struct kscan_matrix_config *config = dev->config;
+        struct kscan_matrix_data *data = dev->data;
+        struct my_kscan_trace *trace = &data->trace;
+        const struct my_kscan_debounce_planes *planes = config->core.debounce_planes;
+        uint32_t frames = 0;
+
+        // Frames published while replaying are left for the next run.
+        while (my_kscan_trace_at(trace, frames)) {
+            frames++;
+        }
+
+        shell_print(sh, "%s: %u frames", dev->name, frames);
+
+        for (int s = 0; s < MY_KSCAN_DEBOUNCE_STRATEGIES; s++) {
+            struct my_kscan_debounce_config debounce = config->core.debounce_config;
+            uint32_t events = 0;
+            uint64_t lag_us = 0;
+
+            debounce.strategy = s;
+
+            for (int w = 0; w < trace->key_words; w++) {
+                struct my_kscan_debounce_word word = {0};
+                uint32_t lagging = 0;
+                uint32_t last_us = 0;
+
+                for (uint32_t f = 0; f < frames; f++) {
+                    const uint32_t *frame = my_kscan_trace_at(trace, f);
+                    const uint32_t raw = frame[MY_KSCAN_TRACE_HEADER_WORDS + w];
+                    const uint32_t time_us = frame[MY_KSCAN_TRACE_TIME_US];
+
+                    if (f > 0) {
+                        lag_us += (uint64_t)__builtin_popcount(lagging) * (time_us - last_us);
+                    }
+
+                    const uint32_t flipped = my_kscan_debounce_update(
+                        &word, raw, &debounce, planes ? &planes[w] : NULL);
+
+                    events += __builtin_popcount(flipped);
+                    lagging = raw ^ word.pressed;
+                    last_us = time_us;
+                }
+            }
+
+            shell_print(sh, " %c%-12s %u events, lag %u us per event",
+                        s == config->core.debounce_config.strategy ? '*' : ' ',
+                        kscan_matrix_debounce_names[s], events,
+                        events ? (uint32_t)(lag_us / events) : 0);
+        }
+    }
+
+    return 0;
+}
+#endif // USE_PACKED_DEBOUNCE
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    sub_my_kscan_trace,
+    IF_ENABLED(CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED,
+               (SHELL_CMD(compare, NULL,
+                          "Replay the trace through every debounce strategy without draining it",
+                          cmd_my_kscan_trace_compare), ))
+    SHELL_SUBCMD_SET_END);
+#endif // USE_TRACE
+
+#if USE_TUNING
+static void kscan_matrix_print_tuning(const struct shell *sh, const char *name,
+                                      const struct kscan_matrix_tuning *tuning) {
+    shell_print(sh, "  %-7s scan-us=%u poll-us=%u press-ms=%u release-ms=%u", name,
+                tuning->scan_period_us, tuning->poll_period_us, tuning->debounce_press_ms,
+                tuning->debounce_release_ms);
+}
+
+#if USE_STATS
+static void kscan_matrix_print_report(const struct shell *sh,
+                                      const struct kscan_matrix_tuning_report *report) {
+    shell_print(sh, "          %u s, %u scans/s at %u us avg, %u presses, press p50<=%u p99<=%u us",
+                report->seconds, report->scans_per_s, report->scan_avg_us, report->presses,
+                report->press_p50_us, report->press_p99_us);
+#if USE_ENERGY
+    shell_print(sh, "          %u scans and %u us of drive per press", report->scans_per_press,
+                report->drive_us_per_press);
+#endif
+}
 #endif
 
+/**
+ * Show the parameters of every matrix. With stats, the timing measured since
+ * they took effect is shown next to the timing of the parameters before them.
+ */
+static int cmd_my_kscan_tune(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        const struct device *dev = kscan_matrix_devices[i];
+        const struct kscan_matrix_data *data = dev->data;
+
+        shell_print(sh, "%s:", dev->name);
+
+#if USE_STATS
+        if (data->tuning_before.valid) {
+            kscan_matrix_print_tuning(sh, "before", &data->tuning_before.tuning);
+            kscan_matrix_print_report(sh, &data->tuning_before);
+        }
+
+        struct kscan_matrix_tuning_report now;
+
+        kscan_matrix_tuning_report(dev, &now);
+        kscan_matrix_print_tuning(sh, "now", &now.tuning);
+        kscan_matrix_print_report(sh, &now);
 #else
-    kscan_matrix_setup_pins(dev);
+        kscan_matrix_print_tuning(sh, "now", &data->tuning);
 #endif
 
+        if (atomic_get(&data->tuning_pending)) {
+            kscan_matrix_print_tuning(sh, "next", &data->tuning_next);
+        }
+    }
+
     return 0;
 }
 
-#if IS_ENABLED(CONFIG_PM_DEVICE)
+static int cmd_my_kscan_tune_set(const struct shell *sh, size_t argc, char **argv) {
+    const struct device *dev = kscan_matrix_find_device(argv[1]);
+    int err = 0;
 
-static int kscan_matrix_pm_action(const struct device *dev, enum pm_device_action action) {
-    switch (action) {
-    case PM_DEVICE_ACTION_SUSPEND:
-        kscan_matrix_disconnect(dev);
+    if (!dev) {
+        shell_error(sh, "No matrix named %s", argv[1]);
+        return -ENODEV;
+    }
 
-        return kscan_matrix_disable(dev);
-    case PM_DEVICE_ACTION_RESUME:
-        kscan_matrix_setup_pins(dev);
-        return kscan_matrix_enable(dev);
-    default:
-        return -ENOTSUP;
+    const unsigned long value = shell_strtoul(argv[3], 10, &err);
+    if (err || value > UINT32_MAX) {
+        shell_error(sh, "Invalid value %s", argv[3]);
+        return -EINVAL;
+    }
+
+    struct kscan_matrix_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->tuning_lock);
+    struct kscan_matrix_tuning tuning = data->tuning_next;
+    k_spin_unlock(&data->tuning_lock, key);
+
+    if (strcmp(argv[2], "scan-us") == 0) {
+        tuning.scan_period_us = value;
+    } else if (strcmp(argv[2], "poll-us") == 0) {
+        tuning.poll_period_us = value;
+    } else if (strcmp(argv[2], "press-ms") == 0) {
+        // Anything this long is rejected by kscan_matrix_tune() anyway.
+        tuning.debounce_press_ms = MIN(value, UINT16_MAX);
+    } else if (strcmp(argv[2], "release-ms") == 0) {
+        tuning.debounce_release_ms = MIN(value, UINT16_MAX);
+    } else {
+        shell_error(sh, "Invalid parameter %s", argv[2]);
+        return -EINVAL;
+    }
+
+    err = kscan_matrix_tune(dev, &tuning);
+    if (err) {
+        shell_error(sh, "Debounce times do not fit at that scan period: %i", err);
+        return err;
     }
+
+    return 0;
 }
 
-#endif // IS_ENABLED(CONFIG_PM_DEVICE)
+static int cmd_my_kscan_tune_reset(const struct shell *sh, size_t argc, char **argv) {
+    const struct device *dev = kscan_matrix_find_device(argv[1]);
 
-static const struct kscan_driver_api kscan_matrix_api = {
-    .config = kscan_matrix_configure,
-    .enable_callback = kscan_matrix_enable,
-    .disable_callback = kscan_matrix_disable,
-};
+    if (!dev) {
+        shell_error(sh, "No matrix named %s", argv[1]);
+        return -ENODEV;
+    }
 
-#define MY_KSCAN_MATRIX_INIT(n)                                                                       \
-    BUILD_ASSERT(INST_DEBOUNCE_PRESS_MS(n) <= DEBOUNCE_COUNTER_MAX,                                \
-                "ZMK_KSCAN_DEBOUNCE_PRESS_MS or debounce-press-ms is too large");                 \
-    BUILD_ASSERT(INST_DEBOUNCE_RELEASE_MS(n) <= DEBOUNCE_COUNTER_MAX,                              \
-                "ZMK_KSCAN_DEBOUNCE_RELEASE_MS or debounce-release-ms is too large");             \
-                                                                                                \
-    static struct kscan_gpio kscan_matrix_rows_##n[] = {                                           \
-        LISTIFY(INST_ROWS_LEN(n), KSCAN_GPIO_ROW_CFG_INIT, (, ), n)};                              \
-                                                                                                \
-    static struct kscan_gpio kscan_matrix_cols_##n[] = {                                           \
-        LISTIFY(INST_COLS_LEN(n), KSCAN_GPIO_COL_CFG_INIT, (, ), n)};                              \
-                                                                                                \
-    static struct zmk_debounce_state kscan_matrix_state_##n[INST_MATRIX_LEN(n)];                   \
-                                                                                                \
-    COND_INTERRUPTS(                                                                               \
-        (static struct kscan_matrix_irq_callback kscan_matrix_irqs_##n[INST_INPUTS_LEN(n)];))      \
-                                                                                                \
-    static struct kscan_matrix_data kscan_matrix_data_##n = {                                      \
-        .inputs =                                                                                  \
-            KSCAN_GPIO_LIST(kscan_matrix_rows_##n),  \
-        .outputs =                                                                                 \
-            KSCAN_GPIO_LIST(kscan_matrix_cols_##n),  \
-        .matrix_state = kscan_matrix_state_##n,                                                    \
-        COND_INTERRUPTS((.irqs = kscan_matrix_irqs_##n, ))};                                       \
-                                                                                                \
-    static const struct kscan_matrix_config kscan_matrix_config_##n = {                            \
-        .rows = ARRAY_SIZE(kscan_matrix_rows_##n),                                                 \
-        .cols = ARRAY_SIZE(kscan_matrix_cols_##n),                                                 \
-        .debounce_config =                                                                         \
-            {                                                                                      \
-                .debounce_press_ms = INST_DEBOUNCE_PRESS_MS(n),                                    \
-                .debounce_release_ms = INST_DEBOUNCE_RELEASE_MS(n),                                \
-            },                                                                                     \
-        .debounce_scan_period_ms = DT_INST_PROP(n, debounce_scan_period_ms),                       \
-        .poll_period_ms = DT_INST_PROP(n, poll_period_ms),                                         \
-        .diode_direction = INST_DIODE_DIR(n),                                                      \
-    };                                                                                             \
-                                                                                                \
-    PM_DEVICE_DT_INST_DEFINE(n, kscan_matrix_pm_action);                                           \
-                                                                                                \
-    DEVICE_DT_INST_DEFINE(n, &my_kscan_matrix_init, PM_DEVICE_DT_INST_GET(n), &kscan_matrix_data_##n, \
-                        &kscan_matrix_config_##n, POST_KERNEL, CONFIG_KSCAN_INIT_PRIORITY,       \
-                        &kscan_matrix_api);
+    const struct kscan_matrix_config *config = dev->config;
 
-DT_INST_FOREACH_STATUS_OKAY(MY_KSCAN_MATRIX_INIT);
+    return kscan_matrix_tune(dev, &config->tuning);
+}
+
+#if IS_ENABLED(CONFIG_SETTINGS)
+static int cmd_my_kscan_tune_save(const struct shell *sh, size_t argc, char **argv) {
+    for (int i = 0; i < ARRAY_SIZE(kscan_matrix_devices); i++) {
+        const struct device *dev = kscan_matrix_devices[i];
+        struct kscan_matrix_data *data = dev->data;
+        char name[64];
+
+        k_spinlock_key_t key = k_spin_lock(&data->tuning_lock);
+        const struct kscan_matrix_tuning tuning = data->tuning_next;
+        k_spin_unlock(&data->tuning_lock, key);
+
+        snprintf(name, sizeof(name), KSCAN_MATRIX_SETTINGS_ROOT "/%s", dev->name);
+
+        const int err = settings_save_one(name, &tuning, sizeof(tuning));
+        if (err) {
+            shell_error(sh, "Failed to save %s: %i", name, err);
+            return err;
+        }
+    }
+
+    shell_print(sh, "Scan parameters saved");
+    return 0;
+}
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    sub_my_kscan_tune,
+    SHELL_CMD_ARG(set, NULL,
+                  "Change a parameter from the next scan: <device> "
+                  "<scan-us|poll-us|press-ms|release-ms> <value>",
+                  cmd_my_kscan_tune_set, 4, 0),
+    SHELL_CMD_ARG(reset, NULL, "Go back to the devicetree parameters: <device>",
+                  cmd_my_kscan_tune_reset, 2, 0),
+    IF_ENABLED(CONFIG_SETTINGS, (SHELL_CMD(save, NULL,
+                                           "Keep the parameters of every matrix across reboots",
+                                           cmd_my_kscan_tune_save), ))
+    SHELL_SUBCMD_SET_END);
+#endif // USE_TUNING
+
+// SHELL_COND_CMD() still names the handler and subcommands of a disabled
+// option, which are not built, so leave out the whole entry instead.
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    sub_my_kscan,
+    IF_ENABLED(CONFIG_ZMK_MY_KSCAN_STATS,
+               (SHELL_CMD(stats, &sub_my_kscan_stats, "Show scan timing for every matrix",
+                          cmd_my_kscan_stats), ))
+    IF_ENABLED(CONFIG_ZMK_MY_KSCAN_ENERGY,
+               (SHELL_CMD(energy, &sub_my_kscan_energy,
+                          "Show scan work per key press and per hour for every matrix",
+                          cmd_my_kscan_energy), ))
+    IF_ENABLED(CONFIG_ZMK_MY_KSCAN_TRACE,
+               (SHELL_CMD(trace, &sub_my_kscan_trace,
+                          "Drain the raw frame trace: sequence, time in us, key bits from word 0",
+                          cmd_my_kscan_trace), ))
+    IF_ENABLED(CONFIG_ZMK_MY_KSCAN_TUNING,
+               (SHELL_CMD(tune, &sub_my_kscan_tune,
+                          "Show the scan parameters of every matrix and their timing",
+                          cmd_my_kscan_tune), ))
+    SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(my_kscan, &sub_my_kscan, "my_kscan matrix driver", NULL);
+
+#endif // IS_ENABLED(CONFIG_SHELL) && (USE_STATS || USE_TRACE || USE_TUNING)
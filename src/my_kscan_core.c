@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "my_kscan_core.h"
+
+#include <stddef.h>
+#include <string.h>
+
+void my_kscan_core_finish(struct my_kscan_core *core, const struct my_kscan_core_config *config) {
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+    core->active_keys = 0;
+    core->settling_keys = 0;
+
+    for (int w = 0; w < config->key_words; w++) {
+        struct my_kscan_debounce_word *word = &core->matrix_state[w];
+
+#ifdef CONFIG_ZMK_MY_KSCAN_QUARANTINE
+        const uint32_t lifted = core->quarantine[w] & ~core->raw_state[w];
+        if (lifted) {
+            core->quarantine[w] &= ~lifted;
+            core->quarantined_keys -= __builtin_popcount(lifted);
+        }
+#endif
+
+        const uint32_t changed =
+            my_kscan_debounce_update(word, core->raw_state[w], &config->debounce_config,
+                                     config->debounce_planes ? &config->debounce_planes[w] : NULL);
+
+        core->raw_state[w] = 0;
+        if (changed) {
+            my_kscan_core_mark_changed(core, w, changed);
+        }
+        core->active_keys += __builtin_popcount(my_kscan_debounce_active(word));
+        core->settling_keys += __builtin_popcount(my_kscan_debounce_settling(word));
+    }
+#else
+    // zmk_debounce_update() already ran as each key was sampled.
+    (void)config;
+#endif
+
+    // Every changed key flipped, so the pressed bitmap only needs the changed words.
+    for (uint32_t words = core->changed_words; words; words &= words - 1) {
+        const int w = __builtin_ctz(words);
+        core->pressed_keys[w] ^= core->changed_keys[w];
+    }
+}
+
+void my_kscan_core_dispatch(struct my_kscan_core *core, const struct my_kscan_core_config *config,
+                            my_kscan_core_event_t event, void *context) {
+    while (core->changed_words) {
+        const int w = __builtin_ctz(core->changed_words);
+        uint32_t changed = core->changed_keys[w];
+
+        core->changed_keys[w] = 0;
+        core->changed_words &= ~(1u << w);
+
+        while (changed) {
+            const int key = w * MY_KSCAN_DEBOUNCE_WORD_BITS + __builtin_ctz(changed);
+
+            changed &= changed - 1;
+
+            event(context, key / config->row_keys, key % config->row_keys,
+                  my_kscan_core_is_pressed(core, key));
+        }
+    }
+}
+
+void my_kscan_core_restart_debounce(struct my_kscan_core *core,
+                                    const struct my_kscan_core_config *config) {
+    core->active_keys = 0;
+    core->settling_keys = 0;
+
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+    for (int w = 0; w < config->key_words; w++) {
+        struct my_kscan_debounce_word *word = &core->matrix_state[w];
+
+        memset(word->counter, 0, sizeof(word->counter));
+        core->active_keys += __builtin_popcount(word->pressed);
+    }
+#else
+    for (int key = 0; key < config->keys; key++) {
+        struct zmk_debounce_state *state = &core->matrix_state[key];
+
+        state->counter = 0;
+        core->active_keys += state->pressed;
+    }
+#endif
+}
+
+#ifdef CONFIG_ZMK_MY_KSCAN_QUARANTINE
+uint32_t my_kscan_core_quarantine_held(struct my_kscan_core *core,
+                                       const struct my_kscan_core_config *config) {
+    core->quarantined_keys = 0;
+
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+    for (int w = 0; w < config->key_words; w++) {
+        const struct my_kscan_debounce_word *word = &core->matrix_state[w];
+
+        core->quarantine[w] = word->pressed & ~my_kscan_debounce_settling(word);
+        core->quarantined_keys += __builtin_popcount(core->quarantine[w]);
+    }
+#else
+    for (int w = 0; w < config->key_words; w++) {
+        core->quarantine[w] = 0;
+    }
+
+    for (int key = 0; key < config->keys; key++) {
+        const struct zmk_debounce_state *state = &core->matrix_state[key];
+
+        if (state->pressed && state->counter == 0) {
+            core->quarantine[key / MY_KSCAN_DEBOUNCE_WORD_BITS] |=
+                1u << (key % MY_KSCAN_DEBOUNCE_WORD_BITS);
+            core->quarantined_keys++;
+        }
+    }
+#endif
+
+    return core->quarantined_keys;
+}
+#endif
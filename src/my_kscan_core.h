@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "my_kscan_debounce.h"
+
+#ifndef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+#include <zmk/debounce.h>
+#endif
+
+/*
+ * Processing of scan results, independent of how the matrix is driven: raw
+ * key samples go in, debounced press and release events come out. Nothing
+ * here depends on Zephyr, so the same code builds for the board and for a
+ * host program that replays recorded scans. Keys are numbered like the debounce
+ * state, row * row_keys + column, and packed 32 to a word for change tracking.
+ *
+ * A scan calls my_kscan_core_sample() once for every key it reads, then
+ * my_kscan_core_finish(). Between finish and my_kscan_core_dispatch(),
+ * changed_keys and pressed_keys describe the scan as a whole.
+ *
+ * Debounce times are counted in scans for both debouncers, so they hold
+ * whatever the scan period is as long as keys are debounced at one rate.
+ */
+
+typedef void (*my_kscan_core_event_t)(void *context, const uint32_t row, const uint32_t column,
+                                      const bool pressed);
+
+struct my_kscan_core_config {
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+    struct my_kscan_debounce_config debounce_config;
+    /** Per-key thresholds, array of length key_words, or NULL to use debounce_config. */
+    struct my_kscan_debounce_planes *debounce_planes;
+#else
+    /** Press and release times counted in scans rather than milliseconds. */
+    struct zmk_debounce_config debounce_config;
+#endif
+    uint16_t keys;
+    uint16_t key_words;
+    /** Keys per row of the event grid. */
+    uint16_t row_keys;
+};
+
+struct my_kscan_core {
+    /** Keys whose debounced state flipped on this scan, array of length key_words. */
+    uint32_t *changed_keys;
+    /** Bit w is set when changed_keys[w] is non-zero. */
+    uint32_t changed_words;
+    /** Debounced pressed state, one bit per key, array of length key_words. */
+    uint32_t *pressed_keys;
+    /** Number of keys that are pressed or still being debounced. */
+    uint32_t active_keys;
+    /** Number of keys still being debounced, whose state may yet flip. */
+    uint32_t settling_keys;
+#ifdef CONFIG_ZMK_MY_KSCAN_QUARANTINE
+    /**
+     * Keys held so long they are treated as stuck, array of length key_words.
+     * They stay pressed but no longer keep the matrix active, and leave
+     * quarantine the first time they are sampled released.
+     */
+    uint32_t *quarantine;
+    uint32_t quarantined_keys;
+#endif
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+    /** Raw state of the current scan, one bit per key, array of length key_words. */
+    uint32_t *raw_state;
+    /** Debounced state, array of length key_words. */
+    struct my_kscan_debounce_word *matrix_state;
+#else
+    /** Debounced state, one entry per key. */
+    struct zmk_debounce_state *matrix_state;
+#endif
+};
+
+static inline void my_kscan_core_mark_changed(struct my_kscan_core *core, const int word,
+                                              const uint32_t keys) {
+    core->changed_keys[word] |= keys;
+    core->changed_words |= 1u << word;
+}
+
+/** Feed the raw state of one key read by the current scan. */
+static inline void my_kscan_core_sample(struct my_kscan_core *core,
+                                        const struct my_kscan_core_config *config, const int key,
+                                        const bool active) {
+    const int word = key / MY_KSCAN_DEBOUNCE_WORD_BITS;
+    const int bit = key % MY_KSCAN_DEBOUNCE_WORD_BITS;
+
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+    (void)config;
+    core->raw_state[word] |= (uint32_t)active << bit;
+#else
+#ifdef CONFIG_ZMK_MY_KSCAN_QUARANTINE
+    if (!active && (core->quarantine[word] >> bit) & 1) {
+        core->quarantine[word] &= ~(1u << bit);
+        core->quarantined_keys--;
+    }
+#endif
+
+    struct zmk_debounce_state *state = &core->matrix_state[key];
+    const bool was_active = zmk_debounce_is_active(state);
+    const bool was_settling = state->counter > 0;
+
+    // One scan elapsed, against thresholds counted in scans.
+    zmk_debounce_update(state, active, 1, &config->debounce_config);
+
+    core->active_keys += (int)zmk_debounce_is_active(state) - (int)was_active;
+    core->settling_keys += (int)(state->counter > 0) - (int)was_settling;
+    if (zmk_debounce_get_changed(state)) {
+        my_kscan_core_mark_changed(core, word, 1u << bit);
+    }
+#endif
+}
+
+/** Complete the debounce update for the current scan once every key has been sampled. */
+void my_kscan_core_finish(struct my_kscan_core *core, const struct my_kscan_core_config *config);
+
+static inline bool my_kscan_core_is_pressed(const struct my_kscan_core *core, const int key) {
+    return (core->pressed_keys[key / MY_KSCAN_DEBOUNCE_WORD_BITS] >>
+            (key % MY_KSCAN_DEBOUNCE_WORD_BITS)) &
+           1;
+}
+
+/** True while key is pressed or still being debounced. */
+static inline bool my_kscan_core_key_is_active(const struct my_kscan_core *core, const int key) {
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED
+    return (my_kscan_debounce_active(&core->matrix_state[key / MY_KSCAN_DEBOUNCE_WORD_BITS]) >>
+            (key % MY_KSCAN_DEBOUNCE_WORD_BITS)) &
+           1;
+#else
+    return zmk_debounce_is_active(&core->matrix_state[key]);
+#endif
+}
+
+/**
+ * Call event for every key whose debounced state flipped on this scan, and
+ * only for those, then clear the changed set.
+ */
+void my_kscan_core_dispatch(struct my_kscan_core *core, const struct my_kscan_core_config *config,
+                            my_kscan_core_event_t event, void *context);
+
+/**
+ * True while any key is pressed or still being debounced, so scanning must go
+ * on. Quarantined keys do not count.
+ */
+static inline bool my_kscan_core_is_active(const struct my_kscan_core *core) {
+#ifdef CONFIG_ZMK_MY_KSCAN_QUARANTINE
+    return core->active_keys > core->quarantined_keys;
+#else
+    return core->active_keys > 0;
+#endif
+}
+
+/**
+ * Restart the count of every key that is still being debounced, keeping the
+ * debounced states, so thresholds changed in config apply from the next scan.
+ */
+void my_kscan_core_restart_debounce(struct my_kscan_core *core,
+                                    const struct my_kscan_core_config *config);
+
+#ifdef CONFIG_ZMK_MY_KSCAN_QUARANTINE
+/** Move every key that is pressed and settled into quarantine. Returns how many are quarantined. */
+uint32_t my_kscan_core_quarantine_held(struct my_kscan_core *core,
+                                       const struct my_kscan_core_config *config);
+
+static inline bool my_kscan_core_is_quarantined(const struct my_kscan_core *core, const int key) {
+    return (core->quarantine[key / MY_KSCAN_DEBOUNCE_WORD_BITS] >>
+            (key % MY_KSCAN_DEBOUNCE_WORD_BITS)) &
+           1;
+}
+#endif
+
+/** True while any key is still being debounced and must be scanned at the debounce rate. */
+static inline bool my_kscan_core_is_settling(const struct my_kscan_core *core) {
+    return core->settling_keys > 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "my_kscan_debounce.h"
+
+static inline uint32_t bit_plane(const uint16_t value, const int bit) {
+    return (value >> bit) & 1 ? UINT32_MAX : 0;
+}
+
+uint32_t my_kscan_debounce_update(struct my_kscan_debounce_word *word, const uint32_t raw,
+                                  const struct my_kscan_debounce_config *config,
+                                  const struct my_kscan_debounce_planes *planes) {
+    const uint32_t pressed = word->pressed;
+    const uint32_t differ = raw ^ pressed;
+
+    // Lanes whose counter equals the threshold of their current state.
+    uint32_t threshold[MY_KSCAN_DEBOUNCE_BITS];
+    uint32_t at_threshold = UINT32_MAX;
+    uint32_t nonzero = 0;
+    for (int i = 0; i < MY_KSCAN_DEBOUNCE_BITS; i++) {
+        if (planes) {
+            threshold[i] = (planes->press[i] & ~pressed) | (planes->release[i] & pressed);
+        } else {
+            threshold[i] = (bit_plane(config->press_ticks, i) & ~pressed) |
+                           (bit_plane(config->release_ticks, i) & pressed);
+        }
+        at_threshold &= ~(word->counter[i] ^ threshold[i]);
+        nonzero |= word->counter[i];
+    }
+
+    // Lanes that flip on their first differing scan, lanes whose counter
+    // restarts on an agreeing scan, and lanes that hold after an eager flip.
+    uint32_t eager = 0;
+    uint32_t restart = 0;
+    uint32_t hold = 0;
+    switch (config->strategy) {
+    case MY_KSCAN_DEBOUNCE_DEFER:
+        restart = UINT32_MAX;
+        break;
+    case MY_KSCAN_DEBOUNCE_EAGER:
+        eager = UINT32_MAX;
+        hold = UINT32_MAX;
+        break;
+    case MY_KSCAN_DEBOUNCE_EAGER_DEFER:
+        eager = ~pressed;
+        restart = pressed;
+        break;
+    default:
+        break;
+    }
+
+    // An eager lane still holding counts down whatever the raw state is.
+    const uint32_t eager_flip = eager & differ & ~nonzero;
+    const uint32_t flip = (differ & at_threshold & ~eager) | eager_flip;
+    const uint32_t increment = differ & ~eager & ~flip;
+    const uint32_t decrement = (~differ & ~restart & nonzero) | (eager & nonzero);
+    const uint32_t clear = flip | (~differ & restart);
+
+    // Ripple the carry of the lanes counting up and the borrow of the lanes
+    // counting down through the bit planes together.
+    uint32_t carry = increment;
+    uint32_t borrow = decrement;
+    for (int i = 0; i < MY_KSCAN_DEBOUNCE_BITS; i++) {
+        const uint32_t bit = word->counter[i];
+        const uint32_t next_carry = bit & carry;
+        const uint32_t next_borrow = ~bit & borrow;
+
+        word->counter[i] = ((bit ^ carry ^ borrow) & ~clear) | (threshold[i] & eager_flip & hold);
+        carry = next_carry;
+        borrow = next_borrow;
+    }
+
+    word->pressed = pressed ^ flip;
+
+    return flip;
+}
+
+uint32_t my_kscan_debounce_settling(const struct my_kscan_debounce_word *word) {
+    uint32_t settling = 0;
+    for (int i = 0; i < MY_KSCAN_DEBOUNCE_BITS; i++) {
+        settling |= word->counter[i];
+    }
+
+    return settling;
+}
+
+uint32_t my_kscan_debounce_active(const struct my_kscan_debounce_word *word) {
+    return word->pressed | my_kscan_debounce_settling(word);
+}
+
+void my_kscan_debounce_planes_fill(struct my_kscan_debounce_planes *planes,
+                                   const struct my_kscan_debounce_config *config) {
+    for (int i = 0; i < MY_KSCAN_DEBOUNCE_BITS; i++) {
+        planes->press[i] = bit_plane(config->press_ticks, i);
+        planes->release[i] = bit_plane(config->release_ticks, i);
+    }
+}
+
+void my_kscan_debounce_planes_set(struct my_kscan_debounce_planes *planes, const int bit,
+                                  const uint16_t press_ticks, const uint16_t release_ticks) {
+    const uint32_t lane = 1u << bit;
+
+    for (int i = 0; i < MY_KSCAN_DEBOUNCE_BITS; i++) {
+        planes->press[i] = (planes->press[i] & ~lane) | (bit_plane(press_ticks, i) & lane);
+        planes->release[i] = (planes->release[i] & ~lane) | (bit_plane(release_ticks, i) & lane);
+    }
+}
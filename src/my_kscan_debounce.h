@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Word-parallel debouncer for 32 keys at a time. It runs the same integrator
+ * as zmk_debounce: the counter of a key goes up on every scan where the raw
+ * state differs from the debounced one, down on every scan where it agrees,
+ * and the key flips once the counter has reached the threshold for its
+ * current state. Counters are stored in vertical form, with bit i of every
+ * key's counter packed into counter[i], so an update costs a few bitwise
+ * operations per counter bit regardless of how many keys changed.
+ *
+ * Thresholds are counted in scans rather than milliseconds. A threshold of
+ * ceil(ms / scan period) scans flips on exactly the same scan as
+ * zmk_debounce_update() called with the scan period as elapsed time.
+ *
+ * The other strategies reuse the same counters. A deferred key counts
+ * consecutive differing scans and restarts on any agreeing one. An eager key
+ * flips on its first differing scan; under the symmetric eager strategy it
+ * then ignores the raw state for the threshold of the transition it made.
+ */
+
+#ifdef CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED_BITS
+#define MY_KSCAN_DEBOUNCE_BITS CONFIG_ZMK_MY_KSCAN_DEBOUNCE_PACKED_BITS
+#else
+#define MY_KSCAN_DEBOUNCE_BITS 4
+#endif
+
+/** Largest threshold, in scans, that the counters can hold. */
+#define MY_KSCAN_DEBOUNCE_TICKS_MAX ((1 << MY_KSCAN_DEBOUNCE_BITS) - 1)
+
+#define MY_KSCAN_DEBOUNCE_WORD_BITS 32
+#define MY_KSCAN_DEBOUNCE_WORDS(keys)                                                              \
+    (((keys) + MY_KSCAN_DEBOUNCE_WORD_BITS - 1) / MY_KSCAN_DEBOUNCE_WORD_BITS)
+
+enum my_kscan_debounce_strategy {
+    /** Count up while the raw state differs and down while it agrees, like zmk_debounce. */
+    MY_KSCAN_DEBOUNCE_INTEGRATOR,
+    /** Flip once the raw state has differed for the whole threshold. */
+    MY_KSCAN_DEBOUNCE_DEFER,
+    /** Flip at once, then hold the new state for the threshold of the transition. */
+    MY_KSCAN_DEBOUNCE_EAGER,
+    /** Report presses at once and defer releases. */
+    MY_KSCAN_DEBOUNCE_EAGER_DEFER,
+    MY_KSCAN_DEBOUNCE_STRATEGIES,
+};
+
+struct my_kscan_debounce_config {
+    /** Scans a press must be seen before it is reported. 0 reports it at once. */
+    uint16_t press_ticks;
+    /** Scans a release must be seen before it is reported. */
+    uint16_t release_ticks;
+    /** One of enum my_kscan_debounce_strategy. */
+    uint8_t strategy;
+};
+
+/** Per-key thresholds of 32 keys, in the same vertical form as the counters. */
+struct my_kscan_debounce_planes {
+    uint32_t press[MY_KSCAN_DEBOUNCE_BITS];
+    uint32_t release[MY_KSCAN_DEBOUNCE_BITS];
+};
+
+/** Debounce state of 32 keys, one bit per key in every field. */
+struct my_kscan_debounce_word {
+    uint32_t pressed;
+    uint32_t counter[MY_KSCAN_DEBOUNCE_BITS];
+};
+
+/**
+ * Feed one scan of raw key states into the debouncer. Thresholds come from
+ * planes, or from config for every key if planes is NULL.
+ *
+ * @return Mask of the keys whose debounced state flipped on this scan.
+ */
+uint32_t my_kscan_debounce_update(struct my_kscan_debounce_word *word, const uint32_t raw,
+                                  const struct my_kscan_debounce_config *config,
+                                  const struct my_kscan_debounce_planes *planes);
+
+/** Give all 32 keys of planes the thresholds of config. */
+void my_kscan_debounce_planes_fill(struct my_kscan_debounce_planes *planes,
+                                   const struct my_kscan_debounce_config *config);
+
+/** Give key bit of planes its own thresholds. */
+void my_kscan_debounce_planes_set(struct my_kscan_debounce_planes *planes, const int bit,
+                                  const uint16_t press_ticks, const uint16_t release_ticks);
+
+/** Mask of the keys whose counter is not zero, so their state may still flip. */
+uint32_t my_kscan_debounce_settling(const struct my_kscan_debounce_word *word);
+
+/** Mask of the keys that are pressed or whose counter has not yet settled. */
+uint32_t my_kscan_debounce_active(const struct my_kscan_debounce_word *word);
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "my_kscan_stats.h"
+
+void my_kscan_histogram_add(struct my_kscan_histogram *hist, const uint32_t value) {
+    int bucket = value ? 32 - __builtin_clz(value) : 0;
+    if (bucket >= MY_KSCAN_HISTOGRAM_BUCKETS) {
+        bucket = MY_KSCAN_HISTOGRAM_BUCKETS - 1;
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum += value;
+    if (value > hist->max) {
+        hist->max = value;
+    }
+}
+
+uint32_t my_kscan_histogram_bucket_limit(const int i) {
+    if (i >= MY_KSCAN_HISTOGRAM_BUCKETS - 1) {
+        return UINT32_MAX;
+    }
+
+    return 1u << i;
+}
+
+uint32_t my_kscan_histogram_percentile(const struct my_kscan_histogram *hist,
+                                       const uint32_t percent) {
+    if (!hist->count) {
+        return 0;
+    }
+
+    const uint64_t rank = ((uint64_t)hist->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < MY_KSCAN_HISTOGRAM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            const uint32_t limit = my_kscan_histogram_bucket_limit(i);
+            return limit < hist->max ? limit : hist->max;
+        }
+    }
+
+    return hist->max;
+}
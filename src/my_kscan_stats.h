@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Log2 histogram of durations in microseconds. Bucket 0 counts zero, bucket i
+ * counts values in [2^(i-1), 2^i) and the last bucket also takes everything
+ * above its lower bound, so recording a sample is a count-leading-zeros and an
+ * increment.
+ */
+
+#define MY_KSCAN_HISTOGRAM_BUCKETS 16
+
+struct my_kscan_histogram {
+    uint32_t buckets[MY_KSCAN_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+    uint64_t sum;
+};
+
+void my_kscan_histogram_add(struct my_kscan_histogram *hist, const uint32_t value);
+
+/** Exclusive upper bound of bucket i, or UINT32_MAX for the last bucket. */
+uint32_t my_kscan_histogram_bucket_limit(const int i);
+
+/**
+ * Upper bound of the bucket holding the given percentile of the samples,
+ * clamped to the largest sample seen. 0 if the histogram is empty.
+ */
+uint32_t my_kscan_histogram_percentile(const struct my_kscan_histogram *hist,
+                                       const uint32_t percent);
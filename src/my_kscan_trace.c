@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "my_kscan_trace.h"
+
+#include <string.h>
+
+static inline uint32_t *frame_at(struct my_kscan_trace *trace, const uint32_t index) {
+    return &trace->buffer[(index & (trace->frames - 1)) *
+                          MY_KSCAN_TRACE_FRAME_WORDS(trace->key_words)];
+}
+
+uint32_t *my_kscan_trace_begin(struct my_kscan_trace *trace) {
+    const uint32_t head = atomic_get(&trace->head);
+
+    trace->seq++;
+
+    if (head - (uint32_t)atomic_get(&trace->tail) >= trace->frames) {
+        trace->dropped++;
+        return NULL;
+    }
+
+    uint32_t *keys = frame_at(trace, head) + MY_KSCAN_TRACE_HEADER_WORDS;
+    memset(keys, 0, trace->key_words * sizeof(uint32_t));
+    return keys;
+}
+
+void my_kscan_trace_commit(struct my_kscan_trace *trace, uint32_t *keys, const uint32_t time_us) {
+    uint32_t *frame = keys - MY_KSCAN_TRACE_HEADER_WORDS;
+
+    frame[MY_KSCAN_TRACE_SEQ] = trace->seq - 1;
+    frame[MY_KSCAN_TRACE_TIME_US] = time_us;
+
+    // atomic_set() is a full barrier, so the frame is visible before the new head.
+    atomic_set(&trace->head, atomic_get(&trace->head) + 1);
+}
+
+const uint32_t *my_kscan_trace_peek(struct my_kscan_trace *trace) {
+    const uint32_t tail = atomic_get(&trace->tail);
+
+    if (tail == (uint32_t)atomic_get(&trace->head)) {
+        return NULL;
+    }
+
+    return frame_at(trace, tail);
+}
+
+void my_kscan_trace_release(struct my_kscan_trace *trace) {
+    atomic_set(&trace->tail, atomic_get(&trace->tail) + 1);
+}
+
+const uint32_t *my_kscan_trace_at(struct my_kscan_trace *trace, const uint32_t index) {
+    const uint32_t tail = atomic_get(&trace->tail);
+
+    if (index >= (uint32_t)atomic_get(&trace->head) - tail) {
+        return NULL;
+    }
+
+    return frame_at(trace, tail + index);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <zephyr/sys/atomic.h>
+
+/*
+ * Single producer, single consumer ring of raw scan frames. The scan writes
+ * the key bits of a frame straight into its slot and publishes it by moving
+ * the head; a reader drains frames from the tail without taking a lock. When
+ * the ring is full the new frame is dropped rather than overwriting one the
+ * reader may be looking at, and the gap shows up in the sequence numbers.
+ *
+ * A frame is MY_KSCAN_TRACE_HEADER_WORDS words of header followed by one bit
+ * per key, in the same order as the debounce state, before debouncing.
+ */
+
+#define MY_KSCAN_TRACE_HEADER_WORDS 2
+#define MY_KSCAN_TRACE_SEQ 0
+#define MY_KSCAN_TRACE_TIME_US 1
+
+#define MY_KSCAN_TRACE_FRAME_WORDS(key_words) (MY_KSCAN_TRACE_HEADER_WORDS + (key_words))
+
+struct my_kscan_trace {
+    /** Array of frames * MY_KSCAN_TRACE_FRAME_WORDS(key_words) words. */
+    uint32_t *buffer;
+    /** Number of frame slots, a power of two. */
+    uint16_t frames;
+    uint16_t key_words;
+    /** Free-running count of published frames. */
+    atomic_t head;
+    /** Free-running count of released frames. */
+    atomic_t tail;
+    /** Sequence number of the next frame, counting dropped ones. */
+    uint32_t seq;
+    uint32_t dropped;
+};
+
+/**
+ * Start a frame. Returns its cleared key bits for the scan to fill in, or
+ * NULL if the ring is full and this scan is not traced.
+ */
+uint32_t *my_kscan_trace_begin(struct my_kscan_trace *trace);
+
+/** Publish the frame returned by the last my_kscan_trace_begin(). */
+void my_kscan_trace_commit(struct my_kscan_trace *trace, uint32_t *keys, const uint32_t time_us);
+
+/** Oldest published frame including its header, or NULL if the ring is empty. */
+const uint32_t *my_kscan_trace_peek(struct my_kscan_trace *trace);
+
+/** Give the frame returned by my_kscan_trace_peek() back to the producer. */
+void my_kscan_trace_release(struct my_kscan_trace *trace);
+
+/**
+ * The index-th published frame counting from the oldest, or NULL past the
+ * newest. Frames are not released, so a later peek sees them again.
+ */
+const uint32_t *my_kscan_trace_at(struct my_kscan_trace *trace, const uint32_t index);
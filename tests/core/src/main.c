@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <string.h>
+
+#include <zephyr/sys/util.h>
+#include <zephyr/ztest.h>
+
+#include "my_kscan_core.h"
+
+/*
+ * Replays raw scans through the scan core the way the driver feeds it: every
+ * key is sampled, then the scan is finished and its events dispatched. Scripts
+ * give one character per scan, '#' for a key read pressed and '_' released.
+ */
+
+#define ROWS 4
+#define COLUMNS 12
+#define KEYS (ROWS * COLUMNS)
+#define KEY_WORDS MY_KSCAN_DEBOUNCE_WORDS(KEYS)
+
+#define PRESS_TICKS 2
+#define RELEASE_TICKS 3
+
+#define MAX_EVENTS 32
+#define RANDOM_SCANS 2000
+
+struct replay_script {
+    uint16_t row;
+    uint16_t column;
+    const char *samples;
+};
+
+struct replay_event {
+    uint16_t scan;
+    uint16_t row;
+    uint16_t column;
+    bool pressed;
+};
+
+static uint32_t changed_keys[KEY_WORDS];
+static uint32_t pressed_keys[KEY_WORDS];
+static uint32_t raw_state[KEY_WORDS];
+static struct my_kscan_debounce_word matrix_state[KEY_WORDS];
+static struct my_kscan_debounce_planes debounce_planes[KEY_WORDS];
+
+static struct my_kscan_core core = {
+    .changed_keys = changed_keys,
+    .pressed_keys = pressed_keys,
+    .raw_state = raw_state,
+    .matrix_state = matrix_state,
+};
+
+static struct my_kscan_core_config config = {
+    .keys = KEYS,
+    .key_words = KEY_WORDS,
+    .row_keys = COLUMNS,
+};
+
+static struct replay_event events[MAX_EVENTS];
+static int event_count;
+static uint16_t scan;
+static uint32_t random_state;
+
+static uint32_t random_next(void) {
+    // xorshift32, so every run replays the same traces.
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static void record_event(void *context, const uint32_t row, const uint32_t column,
+                         const bool pressed) {
+    ARG_UNUSED(context);
+
+    zassert_true(event_count < MAX_EVENTS, "more events than the script can produce");
+    events[event_count++] = (struct replay_event){
+        .scan = scan,
+        .row = row,
+        .column = column,
+        .pressed = pressed,
+    };
+}
+
+/** Marks every dispatched key in the bool array given as context. */
+static void mark_event(void *context, const uint32_t row, const uint32_t column,
+                       const bool pressed) {
+    bool *dispatched = context;
+
+    ARG_UNUSED(pressed);
+    dispatched[row * COLUMNS + column] = true;
+}
+
+static void replay_scan(const bool *raw, my_kscan_core_event_t event, void *context) {
+    for (int key = 0; key < KEYS; key++) {
+        my_kscan_core_sample(&core, &config, key, raw[key]);
+    }
+
+    my_kscan_core_finish(&core, &config);
+    my_kscan_core_dispatch(&core, &config, event, context);
+    scan++;
+}
+
+static void replay_script(const struct replay_script *script, const size_t lines) {
+    const size_t scans = strlen(script[0].samples);
+
+    for (size_t i = 0; i < lines; i++) {
+        zassert_equal(strlen(script[i].samples), scans, "script line %u has a different length",
+                      (unsigned int)i);
+    }
+
+    for (size_t s = 0; s < scans; s++) {
+        bool raw[KEYS] = {0};
+
+        for (size_t i = 0; i < lines; i++) {
+            raw[script[i].row * COLUMNS + script[i].column] |= script[i].samples[s] == '#';
+        }
+
+        replay_scan(raw, record_event, NULL);
+    }
+}
+
+static void check_events(const struct replay_event *expected, const int count) {
+    zassert_equal(event_count, count, "%d events instead of %d", event_count, count);
+
+    for (int i = 0; i < count; i++) {
+        zassert_equal(events[i].scan, expected[i].scan, "event %d on scan %u instead of %u", i,
+                      events[i].scan, expected[i].scan);
+        zassert_equal(events[i].row, expected[i].row, "event %d on row %u", i, events[i].row);
+        zassert_equal(events[i].column, expected[i].column, "event %d on column %u", i,
+                      events[i].column);
+        zassert_equal(events[i].pressed, expected[i].pressed, "event %d has the wrong state", i);
+    }
+}
+
+static void use_strategy(const enum my_kscan_debounce_strategy strategy) {
+    config.debounce_config.strategy = strategy;
+}
+
+/** Reference integrator, zmk_debounce_update() with one scan elapsed and thresholds in scans. */
+struct reference_key {
+    bool pressed;
+    uint16_t counter;
+};
+
+static bool reference_update(struct reference_key *key, const bool active,
+                             const uint16_t press_ticks, const uint16_t release_ticks) {
+    if (active == key->pressed) {
+        key->counter = key->counter > 0 ? key->counter - 1 : 0;
+        return false;
+    }
+
+    if (key->counter < (key->pressed ? release_ticks : press_ticks)) {
+        key->counter++;
+        return false;
+    }
+
+    key->pressed = !key->pressed;
+    key->counter = 0;
+    return true;
+}
+
+/**
+ * Raw state of a key that changes now and then and reads wrong on about one
+ * scan in four, which is worse than any switch but reaches every counter value.
+ */
+static bool random_sample(bool *held) {
+    const uint32_t r = random_next();
+
+    if ((r & 0x1f) == 0) {
+        *held = !*held;
+    }
+
+    return (r >> 5) & 3 ? *held : !*held;
+}
+
+static void random_thresholds(uint16_t *press_ticks, uint16_t *release_ticks) {
+    for (int key = 0; key < KEYS; key++) {
+        press_ticks[key] = random_next() % (MY_KSCAN_DEBOUNCE_TICKS_MAX + 1);
+        release_ticks[key] = random_next() % (MY_KSCAN_DEBOUNCE_TICKS_MAX + 1);
+        my_kscan_debounce_planes_set(&debounce_planes[key / MY_KSCAN_DEBOUNCE_WORD_BITS],
+                                     key % MY_KSCAN_DEBOUNCE_WORD_BITS, press_ticks[key],
+                                     release_ticks[key]);
+    }
+
+    config.debounce_planes = debounce_planes;
+}
+
+static void replay_before(void *fixture) {
+    ARG_UNUSED(fixture);
+
+    memset(changed_keys, 0, sizeof(changed_keys));
+    memset(pressed_keys, 0, sizeof(pressed_keys));
+    memset(raw_state, 0, sizeof(raw_state));
+    memset(matrix_state, 0, sizeof(matrix_state));
+    core.changed_words = 0;
+    core.active_keys = 0;
+    core.settling_keys = 0;
+
+    config.debounce_config = (struct my_kscan_debounce_config){
+        .press_ticks = PRESS_TICKS,
+        .release_ticks = RELEASE_TICKS,
+        .strategy = MY_KSCAN_DEBOUNCE_INTEGRATOR,
+    };
+    config.debounce_planes = NULL;
+
+    event_count = 0;
+    scan = 0;
+    random_state = 0x2545f491;
+}
+
+ZTEST_SUITE(my_kscan_core, NULL, NULL, replay_before, NULL, NULL);
+
+static const struct replay_script clean_script[] = {
+    {1, 4, "__########______"},
+};
+
+/** Scans of the press and the release of clean_script for every strategy. */
+static const uint16_t clean_scans[MY_KSCAN_DEBOUNCE_STRATEGIES][2] = {
+    [MY_KSCAN_DEBOUNCE_INTEGRATOR] = {4, 13},
+    [MY_KSCAN_DEBOUNCE_DEFER] = {4, 13},
+    [MY_KSCAN_DEBOUNCE_EAGER] = {2, 10},
+    [MY_KSCAN_DEBOUNCE_EAGER_DEFER] = {2, 13},
+};
+
+ZTEST(my_kscan_core, test_clean_press) {
+    for (int s = 0; s < MY_KSCAN_DEBOUNCE_STRATEGIES; s++) {
+        const struct replay_event expected[] = {
+            {clean_scans[s][0], 1, 4, true},
+            {clean_scans[s][1], 1, 4, false},
+        };
+
+        replay_before(NULL);
+        use_strategy(s);
+        replay_script(clean_script, ARRAY_SIZE(clean_script));
+        check_events(expected, ARRAY_SIZE(expected));
+        zassert_false(my_kscan_core_is_active(&core), "strategy %d still active", s);
+    }
+}
+
+/*
+ * A key that bounces on press and release, and one that glitches for a single
+ * scan before a short press that chatters once.
+ */
+static const struct replay_script bounce_script[] = {
+    {0, 0, "__#_##_#####_#_#_________"},
+    {2, 7, "______#____###_##________"},
+};
+
+ZTEST(my_kscan_core, test_bounce_integrator) {
+    static const struct replay_event expected[] = {
+        {8, 0, 0, true},
+        {13, 2, 7, true},
+        {19, 0, 0, false},
+        {20, 2, 7, false},
+    };
+
+    use_strategy(MY_KSCAN_DEBOUNCE_INTEGRATOR);
+    replay_script(bounce_script, ARRAY_SIZE(bounce_script));
+    check_events(expected, ARRAY_SIZE(expected));
+}
+
+ZTEST(my_kscan_core, test_bounce_defer) {
+    static const struct replay_event expected[] = {
+        {9, 0, 0, true},
+        {13, 2, 7, true},
+        {19, 0, 0, false},
+        {20, 2, 7, false},
+    };
+
+    use_strategy(MY_KSCAN_DEBOUNCE_DEFER);
+    replay_script(bounce_script, ARRAY_SIZE(bounce_script));
+    check_events(expected, ARRAY_SIZE(expected));
+}
+
+ZTEST(my_kscan_core, test_bounce_eager) {
+    static const struct replay_event expected[] = {
+        {2, 0, 0, true},
+        {6, 0, 0, false},
+        {6, 2, 7, true},
+        {9, 2, 7, false},
+        {10, 0, 0, true},
+        {13, 2, 7, true},
+        {14, 0, 0, false},
+        {17, 2, 7, false},
+    };
+
+    use_strategy(MY_KSCAN_DEBOUNCE_EAGER);
+    replay_script(bounce_script, ARRAY_SIZE(bounce_script));
+    check_events(expected, ARRAY_SIZE(expected));
+}
+
+ZTEST(my_kscan_core, test_bounce_eager_defer) {
+    static const struct replay_event expected[] = {
+        {2, 0, 0, true},
+        {6, 2, 7, true},
+        {10, 2, 7, false},
+        {11, 2, 7, true},
+        {19, 0, 0, false},
+        {20, 2, 7, false},
+    };
+
+    use_strategy(MY_KSCAN_DEBOUNCE_EAGER_DEFER);
+    replay_script(bounce_script, ARRAY_SIZE(bounce_script));
+    check_events(expected, ARRAY_SIZE(expected));
+}
+
+/*
+ * The packed integrator must flip every key on the same scan as zmk_debounce,
+ * with each key on its own thresholds.
+ */
+ZTEST(my_kscan_core, test_integrator_matches_zmk) {
+    uint16_t press_ticks[KEYS];
+    uint16_t release_ticks[KEYS];
+    struct reference_key reference[KEYS] = {0};
+    bool held[KEYS] = {0};
+
+    random_thresholds(press_ticks, release_ticks);
+
+    for (int s = 0; s < RANDOM_SCANS; s++) {
+        bool raw[KEYS];
+        bool dispatched[KEYS] = {0};
+        uint32_t active = 0;
+
+        for (int key = 0; key < KEYS; key++) {
+            raw[key] = random_sample(&held[key]);
+        }
+
+        replay_scan(raw, mark_event, dispatched);
+
+        for (int key = 0; key < KEYS; key++) {
+            const bool changed =
+                reference_update(&reference[key], raw[key], press_ticks[key], release_ticks[key]);
+
+            zassert_equal(dispatched[key], changed, "key %d dispatched wrongly on scan %d", key, s);
+            zassert_equal(my_kscan_core_is_pressed(&core, key), reference[key].pressed,
+                          "key %d in the wrong state on scan %d", key, s);
+            active += reference[key].pressed || reference[key].counter > 0;
+        }
+
+        zassert_equal(core.active_keys, active, "%u keys active instead of %u on scan %d",
+                      core.active_keys, active, s);
+    }
+}
+
+/*
+ * Every strategy must debounce each lane of a word as if it were alone, with
+ * per-key planes giving the same result as the shared thresholds.
+ */
+ZTEST(my_kscan_core, test_strategies_keep_keys_apart) {
+    uint16_t press_ticks[KEYS];
+    uint16_t release_ticks[KEYS];
+
+    random_thresholds(press_ticks, release_ticks);
+
+    for (int strategy = 0; strategy < MY_KSCAN_DEBOUNCE_STRATEGIES; strategy++) {
+        struct my_kscan_debounce_word alone[KEYS] = {0};
+        bool held[KEYS] = {0};
+
+        replay_before(NULL);
+        use_strategy(strategy);
+        config.debounce_planes = debounce_planes;
+
+        for (int s = 0; s < RANDOM_SCANS; s++) {
+            bool raw[KEYS];
+            bool dispatched[KEYS] = {0};
+
+            for (int key = 0; key < KEYS; key++) {
+                raw[key] = random_sample(&held[key]);
+            }
+
+            replay_scan(raw, mark_event, dispatched);
+
+            for (int key = 0; key < KEYS; key++) {
+                const struct my_kscan_debounce_config key_config = {
+                    .press_ticks = press_ticks[key],
+                    .release_ticks = release_ticks[key],
+                    .strategy = strategy,
+                };
+                const bool changed =
+                    my_kscan_debounce_update(&alone[key], raw[key], &key_config, NULL) & 1;
+
+                zassert_equal(dispatched[key], changed,
+                              "strategy %d key %d dispatched wrongly on scan %d", strategy, key,
+                              s);
+                zassert_equal(my_kscan_core_is_pressed(&core, key), alone[key].pressed & 1,
+                              "strategy %d key %d in the wrong state on scan %d", strategy, key,
+                              s);
+            }
+        }
+    }
+}
+
+/*
+ * Event latency for every strategy, for regression tracking. Each key is
+ * pressed with a burst of bounce, held, and released with another burst, out
+ * of phase with the other keys. Latency counts the scans from the start of a
+ * burst to the event it produced.
+ */
+#define BENCH_PERIOD 40
+#define BENCH_BOUNCE 6
+#define BENCH_RELEASE (BENCH_PERIOD / 2)
+#define BENCH_SCANS (BENCH_PERIOD * 50)
+
+struct bench_result {
+    uint32_t presses;
+    uint32_t releases;
+    uint32_t press_scans;
+    uint32_t release_scans;
+};
+
+static void bench_event(void *context, const uint32_t row, const uint32_t column,
+                        const bool pressed) {
+    struct bench_result *result = context;
+    const int key = row * COLUMNS + column;
+    const uint32_t phase = (scan + key) % BENCH_PERIOD;
+
+    if (pressed) {
+        result->presses++;
+        result->press_scans += phase;
+    } else {
+        result->releases++;
+        result->release_scans += (phase + BENCH_PERIOD - BENCH_RELEASE) % BENCH_PERIOD;
+    }
+}
+
+static bool bench_sample(const int key) {
+    const uint32_t phase = (scan + key) % BENCH_PERIOD;
+    const bool pressed = phase < BENCH_RELEASE;
+
+    if (phase % BENCH_RELEASE < BENCH_BOUNCE) {
+        return random_next() & 1 ? pressed : !pressed;
+    }
+
+    return pressed;
+}
+
+ZTEST(my_kscan_core, test_latency) {
+    static const char *const names[MY_KSCAN_DEBOUNCE_STRATEGIES] = {
+        [MY_KSCAN_DEBOUNCE_INTEGRATOR] = "integrator",
+        [MY_KSCAN_DEBOUNCE_DEFER] = "defer",
+        [MY_KSCAN_DEBOUNCE_EAGER] = "eager",
+        [MY_KSCAN_DEBOUNCE_EAGER_DEFER] = "eager-defer",
+    };
+
+    for (int strategy = 0; strategy < MY_KSCAN_DEBOUNCE_STRATEGIES; strategy++) {
+        struct bench_result result = {0};
+
+        replay_before(NULL);
+        use_strategy(strategy);
+
+        for (int s = 0; s < BENCH_SCANS; s++) {
+            bool raw[KEYS];
+
+            for (int key = 0; key < KEYS; key++) {
+                raw[key] = bench_sample(key);
+            }
+
+            replay_scan(raw, bench_event, &result);
+        }
+
+        zassert_true(result.presses > 0 && result.releases > 0, "%s reported nothing",
+                     names[strategy]);
+
+        TC_PRINT("%-12s %u presses %u.%02u scans, %u releases %u.%02u scans\n",
+                 names[strategy], result.presses, result.press_scans / result.presses,
+                 result.press_scans * 100 / result.presses % 100, result.releases,
+                 result.release_scans / result.releases,
+                 result.release_scans * 100 / result.releases % 100);
+    }
+}
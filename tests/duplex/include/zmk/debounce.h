@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/sys/util.h>
+
+/*
+ * Declarations of ZMK's zmk/debounce.h, which the driver includes. src/debounce.c
+ * implements them for the scenario that does not use the packed debouncer.
+ */
+
+#define DEBOUNCE_COUNTER_BITS 14
+#define DEBOUNCE_COUNTER_MAX BIT_MASK(DEBOUNCE_COUNTER_BITS)
+
+struct zmk_debounce_state {
+    bool pressed : 1;
+    bool changed : 1;
+    uint16_t counter : DEBOUNCE_COUNTER_BITS;
+};
+
+struct zmk_debounce_config {
+    uint32_t debounce_press_ms;
+    uint32_t debounce_release_ms;
+};
+
+void zmk_debounce_update(struct zmk_debounce_state *state, const bool active, const int elapsed_ms,
+                         const struct zmk_debounce_config *config);
+bool zmk_debounce_is_active(const struct zmk_debounce_state *state);
+bool zmk_debounce_is_pressed(const struct zmk_debounce_state *state);
+bool zmk_debounce_get_changed(const struct zmk_debounce_state *state);
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zmk/debounce.h>
+
+/*
+ * ZMK's integrator debouncer, as the driver calls it when it is built without
+ * ZMK_MY_KSCAN_DEBOUNCE_PACKED. Every update that disagrees with the reported
+ * state counts up, every one that agrees counts down, and the state flips
+ * once the count reaches the press or release time.
+ */
+
+static uint32_t get_threshold(const struct zmk_debounce_state *state,
+                              const struct zmk_debounce_config *config) {
+    return state->pressed ? config->debounce_release_ms : config->debounce_press_ms;
+}
+
+static void increment_counter(struct zmk_debounce_state *state, const int elapsed_ms) {
+    if (state->counter + elapsed_ms > DEBOUNCE_COUNTER_MAX) {
+        state->counter = DEBOUNCE_COUNTER_MAX;
+    } else {
+        state->counter += elapsed_ms;
+    }
+}
+
+static void decrement_counter(struct zmk_debounce_state *state, const int elapsed_ms) {
+    if (state->counter < elapsed_ms) {
+        state->counter = 0;
+    } else {
+        state->counter -= elapsed_ms;
+    }
+}
+
+void zmk_debounce_update(struct zmk_debounce_state *state, const bool active, const int elapsed_ms,
+                         const struct zmk_debounce_config *config) {
+    state->changed = false;
+
+    if (active == state->pressed) {
+        decrement_counter(state, elapsed_ms);
+        return;
+    }
+
+    if (state->counter < get_threshold(state, config)) {
+        increment_counter(state, elapsed_ms);
+        return;
+    }
+
+    state->pressed = !state->pressed;
+    state->counter = 0;
+    state->changed = true;
+}
+
+bool zmk_debounce_is_active(const struct zmk_debounce_state *state) {
+    return state->pressed || state->counter > 0;
+}
+
+bool zmk_debounce_is_pressed(const struct zmk_debounce_state *state) { return state->pressed; }
+
+bool zmk_debounce_get_changed(const struct zmk_debounce_state *state) { return state->changed; }
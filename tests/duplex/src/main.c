@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/kscan.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/ztest.h>
+
+#include "matrix_gpio.h"
+
+// The driver logs to the module ZMK registers.
+LOG_MODULE_REGISTER(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+/*
+ * Runs the duplex matrix of the overlay against an emulated GPIO controller.
+ * Every crossing of a row and a column holds two keys: the row2col key
+ * conducts from the row to the column, the col2row key from the column to the
+ * row. A row2col key reports its own row and column, a col2row key its row
+ * and the column after the last row2col column of that row.
+ */
+
+#define KSCAN_NODE DT_NODELABEL(kscan)
+#define ROWS DT_PROP_LEN(KSCAN_NODE, row_gpios)
+#define COLS DT_PROP_LEN(KSCAN_NODE, col_gpios)
+
+#define EVENT_TIMEOUT K_MSEC(100)
+#define IDLE_TIME K_MSEC(50)
+
+enum matrix_half {
+    ROW2COL,
+    COL2ROW,
+};
+
+struct matrix_event {
+    uint32_t row;
+    uint32_t column;
+    bool pressed;
+};
+
+static const struct device *const kscan = DEVICE_DT_GET(KSCAN_NODE);
+static const struct device *const matrix =
+    DEVICE_DT_GET(DT_GPIO_CTLR_BY_IDX(KSCAN_NODE, row_gpios, 0));
+
+static const gpio_pin_t row_pins[] = {
+    DT_FOREACH_PROP_ELEM_SEP(KSCAN_NODE, row_gpios, DT_GPIO_PIN_BY_IDX, (, ))};
+static const gpio_pin_t col_pins[] = {
+    DT_FOREACH_PROP_ELEM_SEP(KSCAN_NODE, col_gpios, DT_GPIO_PIN_BY_IDX, (, ))};
+
+K_MSGQ_DEFINE(matrix_events, sizeof(struct matrix_event), 16, 4);
+
+static struct k_spinlock matrix_lock;
+/** Columns each row reaches through a pressed row2col key. */
+static uint32_t row2col_keys[ROWS];
+/** Rows each column reaches through a pressed col2row key. */
+static uint32_t col2row_keys[COLS];
+
+static gpio_port_pins_t line_pins(const gpio_pin_t *pins, const size_t len) {
+    gpio_port_pins_t mask = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        mask |= BIT(pins[i]);
+    }
+
+    return mask;
+}
+
+/** Lines reached from the driven lines through one pressed key. */
+static gpio_port_value_t matrix_sense(const gpio_port_pins_t driven) {
+    k_spinlock_key_t key = k_spin_lock(&matrix_lock);
+    gpio_port_value_t levels = 0;
+
+    for (int row = 0; row < ROWS; row++) {
+        for (int col = 0; col < COLS; col++) {
+            if (driven & BIT(row_pins[row]) && (row2col_keys[row] >> col) & 1) {
+                levels |= BIT(col_pins[col]);
+            }
+            if (driven & BIT(col_pins[col]) && (col2row_keys[col] >> row) & 1) {
+                levels |= BIT(row_pins[row]);
+            }
+        }
+    }
+
+    k_spin_unlock(&matrix_lock, key);
+    return levels;
+}
+
+static void matrix_set_key(const enum matrix_half half, const int row, const int col,
+                           const bool pressed) {
+    k_spinlock_key_t key = k_spin_lock(&matrix_lock);
+
+    if (half == ROW2COL) {
+        WRITE_BIT(row2col_keys[row], col, pressed);
+    } else {
+        WRITE_BIT(col2row_keys[col], row, pressed);
+    }
+
+    k_spin_unlock(&matrix_lock, key);
+
+    matrix_gpio_update(matrix);
+}
+
+static int event_column(const enum matrix_half half, const int col) {
+    return half == ROW2COL ? col : COLS + col;
+}
+
+static void matrix_callback(const struct device *dev, uint32_t row, uint32_t column,
+                            bool pressed) {
+    const struct matrix_event event = {.row = row, .column = column, .pressed = pressed};
+
+    zassert_ok(k_msgq_put(&matrix_events, &event, K_NO_WAIT), "event queue full");
+}
+
+static void expect_event(const int row, const int column, const bool pressed) {
+    struct matrix_event event;
+
+    zassert_ok(k_msgq_get(&matrix_events, &event, EVENT_TIMEOUT),
+               "no event for row %d column %d", row, column);
+    zassert_equal(event.row, row, "event on row %u instead of %d", event.row, row);
+    zassert_equal(event.column, column, "event on column %u instead of %d", event.column,
+                  column);
+    zassert_equal(event.pressed, pressed, "event on row %d column %d has the wrong state", row,
+                  column);
+}
+
+static void expect_no_event(void) {
+    struct matrix_event event;
+
+    zassert_not_equal(k_msgq_get(&matrix_events, &event, IDLE_TIME), 0,
+                      "unexpected event on row %u column %u", event.row, event.column);
+}
+
+/** Press and release one key, expecting both events. */
+static void tap_key(const enum matrix_half half, const int row, const int col) {
+    matrix_set_key(half, row, col, true);
+    expect_event(row, event_column(half, col), true);
+    matrix_set_key(half, row, col, false);
+    expect_event(row, event_column(half, col), false);
+}
+
+static void *duplex_setup(void) {
+    zassert_true(device_is_ready(kscan), "kscan device not ready");
+
+    matrix_gpio_set_sense(matrix, matrix_sense);
+    zassert_ok(kscan_config(kscan, matrix_callback));
+    zassert_ok(kscan_enable_callback(kscan));
+
+    return NULL;
+}
+
+static void duplex_before(void *fixture) {
+    ARG_UNUSED(fixture);
+
+    // Let the matrix go idle and arm for wake.
+    k_sleep(IDLE_TIME);
+    k_msgq_purge(&matrix_events);
+}
+
+ZTEST_SUITE(duplex, NULL, duplex_setup, duplex_before, NULL, NULL);
+
+/* An idle matrix drives every row or every column, and takes turns between them. */
+ZTEST(duplex, test_idle_arms_one_half_at_a_time) {
+    const gpio_port_pins_t rows = line_pins(row_pins, ROWS);
+    const gpio_port_pins_t cols = line_pins(col_pins, COLS);
+    bool rows_armed = false;
+    bool cols_armed = false;
+
+    for (int i = 0; i < 40; i++) {
+        const gpio_port_pins_t driven = matrix_gpio_driven(matrix);
+
+        zassert_true(driven == rows || driven == cols, "idle matrix drives %02x", driven);
+        rows_armed |= driven == rows;
+        cols_armed |= driven == cols;
+        k_sleep(K_MSEC(1));
+    }
+
+    zassert_true(rows_armed && cols_armed, "the armed half never changed");
+}
+
+/* Swapping the armed half only writes ports, whichever way lines are driven while scanning. */
+ZTEST(duplex, test_idle_swaps_without_reconfiguring) {
+    const uint32_t configures = matrix_gpio_configures(matrix);
+
+    k_sleep(IDLE_TIME);
+
+    zassert_equal(matrix_gpio_configures(matrix), configures,
+                  "%u pins reconfigured while idle", matrix_gpio_configures(matrix) - configures);
+}
+
+/* Every key of both halves wakes the matrix and reports its own row and column. */
+ZTEST(duplex, test_every_key_in_both_halves) {
+    for (int half = ROW2COL; half <= COL2ROW; half++) {
+        for (int row = 0; row < ROWS; row++) {
+            for (int col = 0; col < COLS; col++) {
+                tap_key(half, row, col);
+            }
+        }
+    }
+
+    expect_no_event();
+}
+
+/* The two keys on one crossing are told apart, in either order. */
+ZTEST(duplex, test_keys_on_one_crossing) {
+    matrix_set_key(ROW2COL, 1, 2, true);
+    expect_event(1, event_column(ROW2COL, 2), true);
+    matrix_set_key(COL2ROW, 1, 2, true);
+    expect_event(1, event_column(COL2ROW, 2), true);
+    matrix_set_key(ROW2COL, 1, 2, false);
+    expect_event(1, event_column(ROW2COL, 2), false);
+    matrix_set_key(COL2ROW, 1, 2, false);
+    expect_event(1, event_column(COL2ROW, 2), false);
+
+    expect_no_event();
+}
+
+/* Keys held in both halves at once, on different lines, are all reported. */
+ZTEST(duplex, test_keys_held_in_both_halves) {
+    matrix_set_key(COL2ROW, 0, 3, true);
+    expect_event(0, event_column(COL2ROW, 3), true);
+    matrix_set_key(ROW2COL, 2, 0, true);
+    expect_event(2, event_column(ROW2COL, 0), true);
+    matrix_set_key(ROW2COL, 2, 0, false);
+    expect_event(2, event_column(ROW2COL, 0), false);
+    matrix_set_key(COL2ROW, 0, 3, false);
+    expect_event(0, event_column(COL2ROW, 3), false);
+
+    expect_no_event();
+}
+
+/* Batched drive configures every line once, so scanning only writes ports. */
+ZTEST(duplex, test_batched_scan_only_writes_ports) {
+    if (!IS_ENABLED(CONFIG_ZMK_MY_KSCAN_MATRIX_BATCHED_DRIVE)) {
+        ztest_test_skip();
+    }
+
+    const uint32_t configures = matrix_gpio_configures(matrix);
+
+    tap_key(ROW2COL, 0, 0);
+    tap_key(COL2ROW, 2, 3);
+
+    zassert_equal(matrix_gpio_configures(matrix), configures,
+                  "%u pins reconfigured while scanning",
+                  matrix_gpio_configures(matrix) - configures);
+}
+
+/*
+ * Without open-source outputs the halves are swapped by reconfiguring the
+ * lines, and keys in both still wake the matrix.
+ */
+ZTEST(duplex, test_wake_without_open_source) {
+    if (IS_ENABLED(CONFIG_ZMK_MY_KSCAN_MATRIX_BATCHED_DRIVE)) {
+        ztest_test_skip();
+    }
+
+    // The matrix chooses how to arm each time it goes idle, so wake it once.
+    matrix_gpio_set_open_source(matrix, false);
+    tap_key(ROW2COL, 0, 1);
+    k_sleep(IDLE_TIME);
+
+    const uint32_t configures = matrix_gpio_configures(matrix);
+
+    k_sleep(IDLE_TIME);
+    zassert_true(matrix_gpio_configures(matrix) > configures, "halves not swapped");
+
+    tap_key(ROW2COL, 1, 3);
+    tap_key(COL2ROW, 2, 0);
+
+    // Arm with open-source outputs again for the tests that follow.
+    matrix_gpio_set_open_source(matrix, true);
+    tap_key(COL2ROW, 0, 0);
+}
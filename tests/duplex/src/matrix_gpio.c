@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define DT_DRV_COMPAT vnd_matrix_gpio
+
+#include "matrix_gpio.h"
+
+#include <zephyr/drivers/gpio/gpio_utils.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/slist.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Push-pull outputs hold their level, open-source outputs only their high
+ * level, and every other pin reads what the matrix gives it. Interrupts are
+ * raised from a timer one tick after their level appears, and again each
+ * tick for as long as the level holds and the interrupt stays enabled.
+ */
+
+struct matrix_gpio_config {
+    /* gpio_driver_config needs to be first */
+    struct gpio_driver_config common;
+};
+
+struct matrix_gpio_data {
+    /* gpio_driver_data needs to be first */
+    struct gpio_driver_data common;
+    const struct device *dev;
+    struct k_spinlock lock;
+    sys_slist_t callbacks;
+    struct k_timer irq_timer;
+    matrix_gpio_sense_t sense;
+    gpio_port_pins_t outputs;
+    /** Outputs that only drive high. */
+    gpio_port_pins_t open_source;
+    gpio_port_pins_t pull_up;
+    gpio_port_value_t values;
+    gpio_port_pins_t int_enabled;
+    /** Enabled interrupts that trigger on a high level rather than a low one. */
+    gpio_port_pins_t int_high;
+    uint32_t configures;
+    bool no_open_source;
+};
+
+/** Pins driven high. Called with the lock held. */
+static gpio_port_pins_t matrix_gpio_high(const struct matrix_gpio_data *data) {
+    return data->outputs & data->values;
+}
+
+/** Level of every pin. Called with the lock held. */
+static gpio_port_value_t matrix_gpio_levels(const struct matrix_gpio_data *data) {
+    const gpio_port_pins_t high = matrix_gpio_high(data);
+    const gpio_port_pins_t held = (data->outputs & ~data->open_source) | high;
+    gpio_port_value_t levels = data->pull_up;
+
+    if (data->sense) {
+        levels |= data->sense(high);
+    }
+
+    return (data->values & held) | (levels & ~held);
+}
+
+/** Enabled interrupts whose level is present. Called with the lock held. */
+static gpio_port_pins_t matrix_gpio_pending(const struct matrix_gpio_data *data) {
+    return data->int_enabled & ~(matrix_gpio_levels(data) ^ data->int_high);
+}
+
+/** Raise the pending interrupts on the next tick. Called with the lock held. */
+static void matrix_gpio_check(struct matrix_gpio_data *data) {
+    if (matrix_gpio_pending(data)) {
+        k_timer_start(&data->irq_timer, K_TICKS(1), K_NO_WAIT);
+    }
+}
+
+static void matrix_gpio_irq_expired(struct k_timer *timer) {
+    struct matrix_gpio_data *data = CONTAINER_OF(timer, struct matrix_gpio_data, irq_timer);
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+    const gpio_port_pins_t pending = matrix_gpio_pending(data);
+
+    k_spin_unlock(&data->lock, key);
+
+    if (pending) {
+        gpio_fire_callbacks(&data->callbacks, data->dev, pending);
+    }
+
+    key = k_spin_lock(&data->lock);
+    matrix_gpio_check(data);
+    k_spin_unlock(&data->lock, key);
+}
+
+static int matrix_gpio_pin_configure(const struct device *dev, gpio_pin_t pin,
+                                     gpio_flags_t flags) {
+    struct matrix_gpio_data *data = dev->data;
+    const bool single_ended = flags & GPIO_SINGLE_ENDED;
+
+    if (single_ended && ((flags & GPIO_LINE_OPEN_DRAIN) || data->no_open_source)) {
+        return -ENOTSUP;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->configures++;
+    WRITE_BIT(data->outputs, pin, flags & GPIO_OUTPUT);
+    WRITE_BIT(data->open_source, pin, single_ended);
+    WRITE_BIT(data->pull_up, pin, flags & GPIO_PULL_UP);
+    if (flags & GPIO_OUTPUT_INIT_HIGH) {
+        data->values |= BIT(pin);
+    } else if (flags & GPIO_OUTPUT_INIT_LOW) {
+        data->values &= ~BIT(pin);
+    }
+    matrix_gpio_check(data);
+
+    k_spin_unlock(&data->lock, key);
+    return 0;
+}
+
+static int matrix_gpio_port_get_raw(const struct device *dev, gpio_port_value_t *value) {
+    struct matrix_gpio_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    *value = matrix_gpio_levels(data);
+
+    k_spin_unlock(&data->lock, key);
+    return 0;
+}
+
+static int matrix_gpio_port_set_masked_raw(const struct device *dev, gpio_port_pins_t mask,
+                                           gpio_port_value_t value) {
+    struct matrix_gpio_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->values = (data->values & ~mask) | (value & mask);
+    matrix_gpio_check(data);
+
+    k_spin_unlock(&data->lock, key);
+    return 0;
+}
+
+static int matrix_gpio_port_set_bits_raw(const struct device *dev, gpio_port_pins_t pins) {
+    return matrix_gpio_port_set_masked_raw(dev, pins, pins);
+}
+
+static int matrix_gpio_port_clear_bits_raw(const struct device *dev, gpio_port_pins_t pins) {
+    return matrix_gpio_port_set_masked_raw(dev, pins, 0);
+}
+
+static int matrix_gpio_port_toggle_bits(const struct device *dev, gpio_port_pins_t pins) {
+    struct matrix_gpio_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->values ^= pins;
+    matrix_gpio_check(data);
+
+    k_spin_unlock(&data->lock, key);
+    return 0;
+}
+
+static int matrix_gpio_pin_interrupt_configure(const struct device *dev, gpio_pin_t pin,
+                                               enum gpio_int_mode mode,
+                                               enum gpio_int_trig trig) {
+    struct matrix_gpio_data *data = dev->data;
+
+    if (mode != GPIO_INT_MODE_DISABLED &&
+        (mode != GPIO_INT_MODE_LEVEL || trig == GPIO_INT_TRIG_BOTH)) {
+        return -ENOTSUP;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    WRITE_BIT(data->int_enabled, pin, mode == GPIO_INT_MODE_LEVEL);
+    WRITE_BIT(data->int_high, pin, trig == GPIO_INT_TRIG_HIGH);
+    matrix_gpio_check(data);
+
+    k_spin_unlock(&data->lock, key);
+    return 0;
+}
+
+static int matrix_gpio_manage_callback(const struct device *dev, struct gpio_callback *callback,
+                                       bool set) {
+    struct matrix_gpio_data *data = dev->data;
+
+    return gpio_manage_callback(&data->callbacks, callback, set);
+}
+
+void matrix_gpio_set_sense(const struct device *dev, matrix_gpio_sense_t sense) {
+    struct matrix_gpio_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->sense = sense;
+    matrix_gpio_check(data);
+
+    k_spin_unlock(&data->lock, key);
+}
+
+void matrix_gpio_update(const struct device *dev) {
+    struct matrix_gpio_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    matrix_gpio_check(data);
+
+    k_spin_unlock(&data->lock, key);
+}
+
+gpio_port_pins_t matrix_gpio_driven(const struct device *dev) {
+    struct matrix_gpio_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+    const gpio_port_pins_t high = matrix_gpio_high(data);
+
+    k_spin_unlock(&data->lock, key);
+    return high;
+}
+
+uint32_t matrix_gpio_configures(const struct device *dev) {
+    const struct matrix_gpio_data *data = dev->data;
+
+    return data->configures;
+}
+
+void matrix_gpio_set_open_source(const struct device *dev, const bool supported) {
+    struct matrix_gpio_data *data = dev->data;
+
+    data->no_open_source = !supported;
+}
+
+static int matrix_gpio_init(const struct device *dev) {
+    struct matrix_gpio_data *data = dev->data;
+
+    data->dev = dev;
+    k_timer_init(&data->irq_timer, matrix_gpio_irq_expired, NULL);
+
+    return 0;
+}
+
+static const struct gpio_driver_api matrix_gpio_api = {
+    .pin_configure = matrix_gpio_pin_configure,
+    .port_get_raw = matrix_gpio_port_get_raw,
+    .port_set_masked_raw = matrix_gpio_port_set_masked_raw,
+    .port_set_bits_raw = matrix_gpio_port_set_bits_raw,
+    .port_clear_bits_raw = matrix_gpio_port_clear_bits_raw,
+    .port_toggle_bits = matrix_gpio_port_toggle_bits,
+    .pin_interrupt_configure = matrix_gpio_pin_interrupt_configure,
+    .manage_callback = matrix_gpio_manage_callback,
+};
+
+// Initialized before the kernel, so the matrix finds its lines ready.
+#define MATRIX_GPIO_INIT(n)                                                                        \
+    static const struct matrix_gpio_config matrix_gpio_config_##n = {                              \
+        .common = {.port_pin_mask = GPIO_PORT_PIN_MASK_FROM_DT_INST(n)},                           \
+    };                                                                                             \
+    static struct matrix_gpio_data matrix_gpio_data_##n;                                           \
+                                                                                                   \
+    DEVICE_DT_INST_DEFINE(n, matrix_gpio_init, NULL, &matrix_gpio_data_##n,                        \
+                          &matrix_gpio_config_##n, PRE_KERNEL_1, CONFIG_GPIO_INIT_PRIORITY,        \
+                          &matrix_gpio_api);
+
+DT_INST_FOREACH_STATUS_OKAY(MATRIX_GPIO_INIT)
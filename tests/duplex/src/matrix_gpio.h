@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+
+/**
+ * Called with the pins driven high whenever a pin is read, returns the pins
+ * the matrix pulls high through pressed keys. Runs with the controller locked,
+ * so it must not call back into it.
+ */
+typedef gpio_port_value_t (*matrix_gpio_sense_t)(gpio_port_pins_t driven);
+
+void matrix_gpio_set_sense(const struct device *dev, matrix_gpio_sense_t sense);
+
+/** Raise any interrupt the matrix triggers after the keys changed. */
+void matrix_gpio_update(const struct device *dev);
+
+/** Pins currently driven high. */
+gpio_port_pins_t matrix_gpio_driven(const struct device *dev);
+
+/** Number of gpio_pin_configure() calls so far. */
+uint32_t matrix_gpio_configures(const struct device *dev);
+
+/** Accept or reject GPIO_OPEN_SOURCE in later gpio_pin_configure() calls. */
+void matrix_gpio_set_open_source(const struct device *dev, bool supported);
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/drivers/kscan.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/ztest.h>
+
+#include "shift_chain.h"
+
+// The driver logs to the module ZMK registers.
+LOG_MODULE_REGISTER(zmk, CONFIG_ZMK_LOG_LEVEL);
+
+/*
+ * Runs the shift-register matrix of the overlay against an emulated chain of
+ * 74HC595s. The chain reports every pattern it latches, and the emulated
+ * matrix answers by setting the sense lines of the pressed keys whose outputs
+ * are driven, the way the diodes would.
+ */
+
+#define KSCAN_NODE DT_NODELABEL(kscan)
+#define DRIVE_LINES DT_PROP(KSCAN_NODE, drive_lines)
+#define SENSE_LINES DT_PROP_LEN(KSCAN_NODE, sense_gpios)
+
+#define EVENT_TIMEOUT K_MSEC(100)
+#define IDLE_TIME K_MSEC(50)
+#define MAX_LATCHED 256
+
+struct matrix_event {
+    uint32_t row;
+    uint32_t column;
+    bool pressed;
+};
+
+static const struct device *const kscan = DEVICE_DT_GET(KSCAN_NODE);
+static const struct device *const chain = DEVICE_DT_GET(DT_PARENT(KSCAN_NODE));
+static const struct device *const sense_port =
+    DEVICE_DT_GET(DT_GPIO_CTLR_BY_IDX(KSCAN_NODE, sense_gpios, 0));
+
+static const gpio_pin_t sense_pins[] = {
+    DT_FOREACH_PROP_ELEM_SEP(KSCAN_NODE, sense_gpios, DT_GPIO_PIN_BY_IDX, (, ))};
+
+K_MSGQ_DEFINE(matrix_events, sizeof(struct matrix_event), 16, 4);
+
+static struct k_spinlock matrix_lock;
+/** Sense lines each output reaches through a pressed key. */
+static uint32_t matrix_keys[DRIVE_LINES];
+static uint32_t latched[MAX_LATCHED];
+static size_t latched_count;
+
+/** Set the sense lines for outputs. Called with matrix_lock held. */
+static void matrix_sense(const uint32_t outputs) {
+    gpio_port_pins_t pins = 0;
+    gpio_port_value_t values = 0;
+
+    for (int s = 0; s < SENSE_LINES; s++) {
+        pins |= BIT(sense_pins[s]);
+
+        for (int line = 0; line < DRIVE_LINES; line++) {
+            if ((outputs >> line) & 1 && (matrix_keys[line] >> s) & 1) {
+                values |= BIT(sense_pins[s]);
+            }
+        }
+    }
+
+    gpio_emul_input_set_masked(sense_port, pins, values);
+}
+
+static void matrix_latched(const uint32_t outputs) {
+    k_spinlock_key_t key = k_spin_lock(&matrix_lock);
+
+    if (latched_count < MAX_LATCHED) {
+        latched[latched_count++] = outputs;
+    }
+    matrix_sense(outputs);
+
+    k_spin_unlock(&matrix_lock, key);
+}
+
+static void matrix_set_key(const int line, const int sense, const bool pressed) {
+    k_spinlock_key_t key = k_spin_lock(&matrix_lock);
+
+    WRITE_BIT(matrix_keys[line], sense, pressed);
+    matrix_sense(shift_chain_outputs(chain));
+
+    k_spin_unlock(&matrix_lock, key);
+}
+
+static void matrix_callback(const struct device *dev, uint32_t row, uint32_t column,
+                            bool pressed) {
+    const struct matrix_event event = {.row = row, .column = column, .pressed = pressed};
+
+    zassert_ok(k_msgq_put(&matrix_events, &event, K_NO_WAIT), "event queue full");
+}
+
+static void expect_event(const int row, const int column, const bool pressed) {
+    struct matrix_event event;
+
+    zassert_ok(k_msgq_get(&matrix_events, &event, EVENT_TIMEOUT),
+               "no event for row %d column %d", row, column);
+    zassert_equal(event.row, row, "event on row %u instead of %d", event.row, row);
+    zassert_equal(event.column, column, "event on column %u instead of %d", event.column,
+                  column);
+    zassert_equal(event.pressed, pressed, "event on row %d column %d has the wrong state", row,
+                  column);
+}
+
+static void expect_no_event(void) {
+    struct matrix_event event;
+
+    zassert_not_equal(k_msgq_get(&matrix_events, &event, IDLE_TIME), 0,
+                      "unexpected event on row %u column %u", event.row, event.column);
+}
+
+static void *shift_register_setup(void) {
+    zassert_true(device_is_ready(kscan), "kscan device not ready");
+
+    shift_chain_set_latch(chain, matrix_latched);
+    zassert_ok(kscan_config(kscan, matrix_callback));
+    zassert_ok(kscan_enable_callback(kscan));
+
+    return NULL;
+}
+
+static void shift_register_before(void *fixture) {
+    ARG_UNUSED(fixture);
+
+    k_spinlock_key_t key = k_spin_lock(&matrix_lock);
+
+    latched_count = 0;
+
+    k_spin_unlock(&matrix_lock, key);
+
+    // Let the matrix go idle and arm for wake.
+    k_sleep(IDLE_TIME);
+    k_msgq_purge(&matrix_events);
+}
+
+ZTEST_SUITE(shift_register, NULL, shift_register_setup, shift_register_before, NULL, NULL);
+
+/*
+ * An idle matrix drives every output for wake. Output 0 is the first output
+ * of the register nearest the controller, so the last byte shifted out holds
+ * outputs 0 to 7.
+ */
+ZTEST(shift_register, test_armed_outputs) {
+    const uint32_t armed = BIT_MASK(DRIVE_LINES);
+
+    zassert_equal(shift_chain_outputs(chain), armed, "armed outputs %04x instead of %04x",
+                  shift_chain_outputs(chain), armed);
+}
+
+/* A key on every output, including those of the second register, reports its own row. */
+ZTEST(shift_register, test_key_on_every_output) {
+    for (int line = 0; line < DRIVE_LINES; line++) {
+        const int sense = line % SENSE_LINES;
+
+        matrix_set_key(line, sense, true);
+        expect_event(line, sense, true);
+        matrix_set_key(line, sense, false);
+        expect_event(line, sense, false);
+    }
+
+    expect_no_event();
+}
+
+ZTEST(shift_register, test_keys_on_one_sense_line) {
+    matrix_set_key(2, 1, true);
+    expect_event(2, 1, true);
+    matrix_set_key(9, 1, true);
+    expect_event(9, 1, true);
+    matrix_set_key(2, 1, false);
+    expect_event(2, 1, false);
+    matrix_set_key(9, 1, false);
+    expect_event(9, 1, false);
+
+    expect_no_event();
+}
+
+/*
+ * While scanning, every pattern drives one output alone, in increasing order,
+ * and a scan ends with a pattern that drives none or every output.
+ */
+ZTEST(shift_register, test_scan_drives_one_output_at_a_time) {
+    int scans = 0;
+    int last = -1;
+
+    matrix_set_key(8, 3, true);
+    expect_event(8, 3, true);
+    matrix_set_key(8, 3, false);
+    expect_event(8, 3, false);
+
+    k_spinlock_key_t key = k_spin_lock(&matrix_lock);
+    const size_t count = latched_count;
+
+    k_spin_unlock(&matrix_lock, key);
+
+    zassert_true(count > 0 && count < MAX_LATCHED, "%zu patterns latched", count);
+
+    for (size_t i = 0; i < count; i++) {
+        const uint32_t outputs = latched[i];
+
+        if (outputs == 0 || outputs == BIT_MASK(DRIVE_LINES)) {
+            scans += last == DRIVE_LINES - 1;
+            last = -1;
+            continue;
+        }
+
+        zassert_equal(outputs & (outputs - 1), 0, "pattern %zu drives %04x", i, outputs);
+
+        const int line = find_lsb_set(outputs) - 1;
+
+        zassert_equal(line, last + 1, "pattern %zu drives output %d after %d", i, line, last);
+        last = line;
+    }
+
+    zassert_true(scans > 0, "no complete scan latched");
+}
+
+/* Asynchronous transfers are used exactly when the driver is built for them. */
+ZTEST(shift_register, test_transfer_mode) {
+    if (IS_ENABLED(CONFIG_ZMK_MY_KSCAN_SHIFT_REGISTER_ASYNC)) {
+        zassert_true(shift_chain_async_transfers(chain) > 0, "no asynchronous transfer");
+    } else {
+        zassert_equal(shift_chain_async_transfers(chain), 0, "unexpected asynchronous transfer");
+    }
+}
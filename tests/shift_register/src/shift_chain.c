@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#define DT_DRV_COMPAT vnd_shift_register_spi
+
+#include "shift_chain.h"
+
+#include <zephyr/drivers/spi.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+/*
+ * Every bit clocked out moves the chain along by one stage, so the first bit
+ * of a transfer ends up on the last output. An asynchronous transfer only
+ * latches one tick after it starts, so a driver that senses before waiting
+ * for it sees the previous outputs.
+ */
+
+struct shift_chain_config {
+    uint8_t registers;
+};
+
+struct shift_chain_data {
+    const struct device *dev;
+    struct k_spinlock lock;
+    uint32_t chain;
+    uint32_t outputs;
+    uint32_t async_transfers;
+    shift_chain_latch_t latch;
+#if IS_ENABLED(CONFIG_SPI_ASYNC)
+    struct k_timer timer;
+    spi_callback_t callback;
+    void *userdata;
+    bool busy;
+#endif
+};
+
+static int shift_chain_shift(const struct device *dev, const struct spi_config *spi_config,
+                             const struct spi_buf_set *tx_bufs) {
+    const struct shift_chain_config *config = dev->config;
+    struct shift_chain_data *data = dev->data;
+
+    if ((spi_config->operation & SPI_TRANSFER_LSB) ||
+        SPI_WORD_SIZE_GET(spi_config->operation) != 8) {
+        return -ENOTSUP;
+    }
+
+    for (size_t i = 0; tx_bufs && i < tx_bufs->count; i++) {
+        const struct spi_buf *buf = &tx_bufs->buffers[i];
+
+        for (size_t j = 0; j < buf->len; j++) {
+            const uint8_t byte = buf->buf ? ((const uint8_t *)buf->buf)[j] : 0;
+
+            for (int bit = 7; bit >= 0; bit--) {
+                data->chain = (data->chain << 1) | ((byte >> bit) & 1);
+            }
+        }
+    }
+
+    data->chain &= BIT64_MASK(8 * config->registers);
+    return 0;
+}
+
+static void shift_chain_latch(const struct device *dev) {
+    struct shift_chain_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->outputs = data->chain;
+
+    const shift_chain_latch_t latch = data->latch;
+    const uint32_t outputs = data->outputs;
+
+    k_spin_unlock(&data->lock, key);
+
+    if (latch) {
+        latch(outputs);
+    }
+}
+
+static int shift_chain_transceive(const struct device *dev, const struct spi_config *spi_config,
+                                  const struct spi_buf_set *tx_bufs,
+                                  const struct spi_buf_set *rx_bufs) {
+#if IS_ENABLED(CONFIG_SPI_ASYNC)
+    struct shift_chain_data *data = dev->data;
+
+    if (data->busy) {
+        return -EBUSY;
+    }
+#endif
+
+    const int err = shift_chain_shift(dev, spi_config, tx_bufs);
+    if (err) {
+        return err;
+    }
+
+    shift_chain_latch(dev);
+    return 0;
+}
+
+#if IS_ENABLED(CONFIG_SPI_ASYNC)
+static void shift_chain_timer_expired(struct k_timer *timer) {
+    struct shift_chain_data *data = CONTAINER_OF(timer, struct shift_chain_data, timer);
+
+    shift_chain_latch(data->dev);
+    data->busy = false;
+    data->callback(data->dev, 0, data->userdata);
+}
+
+static int shift_chain_transceive_async(const struct device *dev,
+                                        const struct spi_config *spi_config,
+                                        const struct spi_buf_set *tx_bufs,
+                                        const struct spi_buf_set *rx_bufs, spi_callback_t cb,
+                                        void *userdata) {
+    struct shift_chain_data *data = dev->data;
+
+    if (data->busy) {
+        return -EBUSY;
+    }
+
+    const int err = shift_chain_shift(dev, spi_config, tx_bufs);
+    if (err) {
+        return err;
+    }
+
+    data->busy = true;
+    data->callback = cb;
+    data->userdata = userdata;
+    data->async_transfers++;
+    k_timer_start(&data->timer, K_TICKS(1), K_NO_WAIT);
+    return 0;
+}
+#endif
+
+static int shift_chain_release(const struct device *dev, const struct spi_config *spi_config) {
+    return 0;
+}
+
+void shift_chain_set_latch(const struct device *dev, shift_chain_latch_t latch) {
+    struct shift_chain_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->latch = latch;
+
+    k_spin_unlock(&data->lock, key);
+}
+
+uint32_t shift_chain_outputs(const struct device *dev) {
+    struct shift_chain_data *data = dev->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+    const uint32_t outputs = data->outputs;
+
+    k_spin_unlock(&data->lock, key);
+    return outputs;
+}
+
+uint32_t shift_chain_async_transfers(const struct device *dev) {
+    const struct shift_chain_data *data = dev->data;
+
+    return data->async_transfers;
+}
+
+static int shift_chain_init(const struct device *dev) {
+    struct shift_chain_data *data = dev->data;
+
+    data->dev = dev;
+#if IS_ENABLED(CONFIG_SPI_ASYNC)
+    k_timer_init(&data->timer, shift_chain_timer_expired, NULL);
+#endif
+
+    return 0;
+}
+
+static const struct spi_driver_api shift_chain_api = {
+    .transceive = shift_chain_transceive,
+#if IS_ENABLED(CONFIG_SPI_ASYNC)
+    .transceive_async = shift_chain_transceive_async,
+#endif
+    .release = shift_chain_release,
+};
+
+// Initialized before the kernel, so the matrix finds its bus ready.
+#define SHIFT_CHAIN_INIT(n)                                                                        \
+    BUILD_ASSERT(DT_INST_PROP(n, registers) <= 4, "The outputs must fit in 32 bits");              \
+                                                                                                   \
+    static const struct shift_chain_config shift_chain_config_##n = {                              \
+        .registers = DT_INST_PROP(n, registers),                                                   \
+    };                                                                                             \
+    static struct shift_chain_data shift_chain_data_##n;                                           \
+                                                                                                   \
+    DEVICE_DT_INST_DEFINE(n, shift_chain_init, NULL, &shift_chain_data_##n,                        \
+                          &shift_chain_config_##n, PRE_KERNEL_1, CONFIG_SPI_INIT_PRIORITY,         \
+                          &shift_chain_api);
+
+DT_INST_FOREACH_STATUS_OKAY(SHIFT_CHAIN_INIT)
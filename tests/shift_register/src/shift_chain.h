@@ -0,0 +1,22 @@
+/*
+ * Copyright (c) 2020-2021 The ZMK Contributors
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <zephyr/device.h>
+
+/** Called with the new outputs each time the chain latches, from a timer for async transfers. */
+typedef void (*shift_chain_latch_t)(uint32_t outputs);
+
+void shift_chain_set_latch(const struct device *dev, shift_chain_latch_t latch);
+
+/** Outputs latched by the last transfer that ended, bit 0 for output 0. */
+uint32_t shift_chain_outputs(const struct device *dev);
+
+/** Number of transfers started with spi_transceive_cb() or its wrappers. */
+uint32_t shift_chain_async_transfers(const struct device *dev);